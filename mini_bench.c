@@ -0,0 +1,670 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LOCALHOST_IP 2130706433 // 127.0.0.1 in decimal
+#define MAX_THREADS 256
+#define RECEIVE_BUFFER_SIZE 65536
+#define HEADER_SIZE 64 // Start of a received line kept to read its timestamp
+#define MAX_EVENTS 256
+#define SETTLE_USEC 500000 // Drain arrival notices before measuring
+#define GRACE_USEC 1000000 // Keep receiving after the last send
+#define RING_HEADER_SIZE 4096 // Ring data starts after the header page
+#define RING_WAIT_EVENTFD 2	  // consumer_waiting: wake this client through its eventfd
+
+// Log-linear latency histogram (HDR style): every power of two is split
+// into 2^HISTOGRAM_SUB_BITS linear buckets, so values keep < 1% error
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+// Benchmark phases, advanced by the main thread
+#define PHASE_CONNECTING 0
+#define PHASE_SETTLING 1
+#define PHASE_MEASURING 2
+#define PHASE_DRAINING 3
+#define PHASE_DONE 4
+
+typedef struct s_histogram
+{
+	unsigned long counts[HISTOGRAM_BUCKETS];
+	unsigned long total;
+	unsigned long max;
+} t_histogram;
+
+// mini_serv_V2's shared memory ring header: the server writes at tail, we
+// read at head, and each side sets its waiting flag before it sleeps
+typedef struct s_ring_header
+{
+	uint64_t size;
+	uint64_t tail;
+	uint32_t wake_sequence;
+	uint32_t consumer_waiting;
+	uint32_t closed;
+	char padding[64 - 2 * sizeof(uint64_t) - 3 * sizeof(uint32_t)];
+	uint64_t head;
+	uint32_t producer_waiting;
+} t_ring_header;
+
+typedef struct s_connection
+{
+	int fd;
+	int sender;					 // Sends timestamped lines while measuring
+	unsigned long next_send;	 // Monotonic time the next line is due, ns
+	char *pending;				 // Unsent tail of the last line
+	size_t pending_length;
+	char header[HEADER_SIZE];	 // First bytes of the line being received
+	size_t header_length;
+	t_ring_header *ring;		 // With BENCH_RING, lines arrive here instead of on fd
+	int ring_wake_fd;			 // Signalled by the server once we wait
+	int ring_space_fd;			 // Signalled by us when the server waits for room
+} t_connection;
+
+// Everything one load thread owns; merged by main() at the end
+typedef struct s_load_thread
+{
+	pthread_t thread;
+	int epoll_fd;
+	t_connection *connections;
+	int connection_count;
+	unsigned long lines_sent;
+	unsigned long send_stalls; // Lines delayed because the socket was full
+	unsigned long lines_received;
+	unsigned long bytes_received;
+	t_histogram latency;
+} t_load_thread;
+
+typedef struct s_config
+{
+	int port;
+	int connections; // Clients kept connected for the whole run
+	int threads;	 // Load threads sharing those clients
+	int senders;	 // Clients that send lines, the others only receive
+	long rate;		 // Lines per second per sender
+	long line_size;	 // Bytes per line, newline included
+	long duration;	 // Seconds of measurement
+	long churn;		 // Extra connect/close cycles per second, 0 = none
+	const char *unix_path; // Connect to this Unix socket instead of the port
+	int ring;			   // Receive through mini_serv_V2's shared memory rings
+} t_config;
+
+t_config config;
+t_load_thread load_threads[MAX_THREADS];
+int phase = PHASE_CONNECTING;
+int connected_threads = 0;
+unsigned long churn_cycles = 0;
+
+// ============================================================================
+// ERROR HANDLING
+// ============================================================================
+
+void fatal_error(const char *error_message)
+{
+	if (error_message)
+		write(STDERR_FILENO, error_message, strlen(error_message));
+	else
+		write(STDERR_FILENO, "Fatal error\n", 12);
+	exit(1);
+}
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+// Read an integer knob from the environment, rejecting values outside [min, max]
+long config_number(const char *name, long default_value, long min, long max)
+{
+	const char *value = getenv(name);
+	char *end;
+	long number;
+
+	if (value == NULL)
+		return default_value;
+	number = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || number < min || number > max)
+	{
+		write(STDERR_FILENO, "Invalid ", 8);
+		fatal_error(name);
+	}
+	return number;
+}
+
+void load_config(void)
+{
+	config.connections = config_number("BENCH_CONNECTIONS", 100, 2, 1000000);
+	config.threads = config_number("BENCH_THREADS", 4, 1, MAX_THREADS);
+	config.senders = config_number("BENCH_SENDERS", 1, 1, config.connections);
+	config.rate = config_number("BENCH_RATE", 1000, 1, 1000000);
+	config.line_size = config_number("BENCH_SIZE", 64, 32, 1 << 20);
+	config.duration = config_number("BENCH_DURATION", 10, 1, 3600);
+	config.churn = config_number("BENCH_CHURN", 0, 0, 1000000);
+	config.unix_path = getenv("BENCH_UNIX_PATH");
+	if (config.unix_path &&
+		(*config.unix_path == '\0' || strlen(config.unix_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)))
+		fatal_error("Invalid BENCH_UNIX_PATH\n");
+	config.ring = config_number("BENCH_RING", 0, 0, 1);
+	if (config.ring && config.unix_path == NULL)
+		fatal_error("BENCH_RING needs BENCH_UNIX_PATH\n");
+	if (config.threads > config.connections)
+		config.threads = config.connections;
+}
+
+// ============================================================================
+// TIME AND HISTOGRAM
+// ============================================================================
+
+unsigned long now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+int current_phase(void)
+{
+	return __atomic_load_n(&phase, __ATOMIC_ACQUIRE);
+}
+
+void histogram_record(t_histogram *histogram, unsigned long value)
+{
+	size_t index = value;
+
+	if (value >= (1UL << HISTOGRAM_SUB_BITS))
+	{
+		int exponent = 63 - __builtin_clzl(value);
+		int shift = exponent - HISTOGRAM_SUB_BITS;
+
+		index = ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + (value >> shift) - (1UL << HISTOGRAM_SUB_BITS);
+	}
+	histogram->counts[index]++;
+	histogram->total++;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+// Highest value that lands in bucket index
+unsigned long histogram_bucket_limit(size_t index)
+{
+	size_t band = index >> HISTOGRAM_SUB_BITS;
+	unsigned long sub = index & ((1UL << HISTOGRAM_SUB_BITS) - 1);
+
+	if (band == 0)
+		return sub;
+	return ((sub + (1UL << HISTOGRAM_SUB_BITS) + 1) << (band - 1)) - 1;
+}
+
+unsigned long histogram_percentile(const t_histogram *histogram, double percentile)
+{
+	unsigned long rank = (unsigned long)(percentile / 100.0 * histogram->total + 0.5);
+	unsigned long seen = 0;
+
+	if (rank == 0)
+		rank = 1;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->counts[i];
+		if (seen >= rank)
+			return histogram_bucket_limit(i) < histogram->max ? histogram_bucket_limit(i) : histogram->max;
+	}
+	return histogram->max;
+}
+
+void histogram_merge(t_histogram *into, const t_histogram *from)
+{
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		into->counts[i] += from->counts[i];
+	into->total += from->total;
+	if (from->max > into->max)
+		into->max = from->max;
+}
+
+// ============================================================================
+// CONNECTIONS
+// ============================================================================
+
+int connect_to_server(void)
+{
+	struct sockaddr_in server_address;
+	int fd;
+
+	if (config.unix_path)
+	{
+		struct sockaddr_un unix_address;
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			fatal_error(NULL);
+		bzero(&unix_address, sizeof(unix_address));
+		unix_address.sun_family = AF_UNIX;
+		strcpy(unix_address.sun_path, config.unix_path);
+		if (connect(fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) < 0)
+			fatal_error("Cannot connect to the server\n");
+		return fd;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		fatal_error(NULL);
+	bzero(&server_address, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+	server_address.sin_addr.s_addr = htonl(LOCALHOST_IP);
+	server_address.sin_port = htons(config.port);
+	if (connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+		fatal_error("Cannot connect to the server\n");
+	return fd;
+}
+
+// Ask for a ring and map it. Everything before the reply is arrival notices,
+// which are not measured; the reply carries the memfd and both eventfds.
+void open_ring(t_connection *connection)
+{
+	char data[4096];
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr header;
+	struct iovec iov = {.iov_base = data, .iov_len = sizeof(data)};
+	struct cmsghdr *message = NULL;
+	struct stat status;
+	int fds[3];
+
+	if (send(connection->fd, "/ring\n", 6, MSG_NOSIGNAL) != 6)
+		fatal_error("Lost connection to the server\n");
+	while (message == NULL)
+	{
+		bzero(&header, sizeof(header));
+		header.msg_iov = &iov;
+		header.msg_iovlen = 1;
+		header.msg_control = control;
+		header.msg_controllen = sizeof(control);
+		if (recvmsg(connection->fd, &header, MSG_CMSG_CLOEXEC) <= 0)
+			fatal_error("No ring from the server\n");
+		message = CMSG_FIRSTHDR(&header);
+	}
+	if (message->cmsg_type != SCM_RIGHTS || message->cmsg_len != CMSG_LEN(sizeof(fds)))
+		fatal_error("No ring from the server\n");
+	memcpy(fds, CMSG_DATA(message), sizeof(fds));
+	if (fstat(fds[0], &status) < 0)
+		fatal_error(NULL);
+	connection->ring = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (connection->ring == MAP_FAILED)
+		fatal_error(NULL);
+	close(fds[0]);
+	connection->ring_wake_fd = fds[1];
+	connection->ring_space_fd = fds[2];
+}
+
+// Lines carry their send time so any receiver can compute the latency
+size_t format_line(char *line, unsigned long timestamp)
+{
+	int length = snprintf(line, HEADER_SIZE, "%lu ", timestamp);
+
+	memset(line + length, 'x', config.line_size - length - 1);
+	line[config.line_size - 1] = '\n';
+	return config.line_size;
+}
+
+// Returns 0 once the socket is full and the rest of line is kept pending
+int send_line(t_connection *connection, const char *line, size_t length)
+{
+	ssize_t sent = send(connection->fd, line, length, MSG_NOSIGNAL);
+
+	if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		fatal_error("Lost connection to the server\n");
+	if (sent < 0)
+		sent = 0;
+	if ((size_t)sent == length)
+		return 1;
+	memmove(connection->pending, line + sent, length - sent);
+	connection->pending_length = length - sent;
+	return 0;
+}
+
+void flush_pending(t_connection *connection)
+{
+	char *tail = connection->pending;
+	size_t length = connection->pending_length;
+
+	connection->pending_length = 0;
+	send_line(connection, tail, length);
+}
+
+// Send every line this sender is due, at its configured rate
+void send_due_lines(t_load_thread *self, t_connection *connection, unsigned long now, char *line)
+{
+	unsigned long interval = 1000000000UL / config.rate;
+
+	if (connection->pending_length > 0)
+		flush_pending(connection);
+	while (connection->next_send <= now)
+	{
+		if (connection->pending_length > 0)
+		{
+			self->send_stalls++;
+			return;
+		}
+		send_line(connection, line, format_line(line, now_ns()));
+		self->lines_sent++;
+		connection->next_send += interval;
+	}
+}
+
+// Parse lines of the form "client <id>: <timestamp> xxx...\n"; only their
+// first HEADER_SIZE bytes are kept, the rest is skipped with memchr()
+void parse_lines(t_load_thread *self, t_connection *connection, const char *data, size_t length)
+{
+	const char *cursor = data, *end = data + length;
+
+	self->bytes_received += length;
+	while (cursor < end)
+	{
+		const char *newline = memchr(cursor, '\n', end - cursor);
+		const char *stop = newline ? newline : end;
+		size_t room = HEADER_SIZE - 1 - connection->header_length;
+		size_t take = (size_t)(stop - cursor) < room ? (size_t)(stop - cursor) : room;
+
+		memcpy(connection->header + connection->header_length, cursor, take);
+		connection->header_length += take;
+		if (newline == NULL)
+			break;
+		connection->header[connection->header_length] = '\0';
+		char *separator = strstr(connection->header, ": ");
+		if (strncmp(connection->header, "client ", 7) == 0 && separator)
+		{
+			histogram_record(&self->latency, now_ns() - strtoul(separator + 2, NULL, 10));
+			self->lines_received++;
+		}
+		connection->header_length = 0;
+		cursor = newline + 1;
+	}
+}
+
+void receive_lines(t_load_thread *self, t_connection *connection, char *buffer)
+{
+	while (1)
+	{
+		ssize_t received = recv(connection->fd, buffer, RECEIVE_BUFFER_SIZE, 0);
+
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		// Once the run is over, other threads closing their clients can take
+		// down servers that die on SIGPIPE; that is not a failure of the run
+		if (received <= 0 && current_phase() == PHASE_DONE)
+			return;
+		if (received <= 0)
+			fatal_error("Lost connection to the server\n");
+		parse_lines(self, connection, buffer, received);
+	}
+}
+
+// Read the ring dry, in place, then ask for an eventfd wakeup and look once
+// more in case a line landed before the server could see the request
+void receive_ring(t_load_thread *self, t_connection *connection)
+{
+	t_ring_header *ring = connection->ring;
+	char *data = (char *)ring + RING_HEADER_SIZE;
+	uint64_t head = ring->head, count, one = 1;
+
+	read(connection->ring_wake_fd, &count, sizeof(count));
+	while (1)
+	{
+		uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+		if (head == tail)
+		{
+			__atomic_store_n(&ring->consumer_waiting, RING_WAIT_EVENTFD, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != head)
+				continue;
+			if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) && current_phase() != PHASE_DONE)
+				fatal_error("Lost connection to the server\n");
+			return;
+		}
+		size_t position = head & (ring->size - 1);
+		size_t length = tail - head < ring->size - position ? tail - head : ring->size - position;
+
+		parse_lines(self, connection, data + position, length);
+		head += length;
+		__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST))
+			write(connection->ring_space_fd, &one, sizeof(one));
+	}
+}
+
+// ============================================================================
+// LOAD THREADS
+// ============================================================================
+
+void service_connections(t_load_thread *self, int timeout_ms, char *buffer)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int ready_count = epoll_wait(self->epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+	for (int i = 0; i < ready_count; i++)
+	{
+		t_connection *connection = events[i].data.ptr;
+
+		if (events[i].events & EPOLLOUT && connection->pending_length > 0)
+			flush_pending(connection);
+		if (events[i].events & ~EPOLLOUT && connection->ring)
+			receive_ring(self, connection);
+		else if (events[i].events & ~EPOLLOUT)
+			receive_lines(self, connection, buffer);
+	}
+}
+
+void *load_thread_main(void *argument)
+{
+	t_load_thread *self = argument;
+	char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+	char *line = malloc(config.line_size);
+
+	if (buffer == NULL || line == NULL)
+		fatal_error(NULL);
+
+	// Connect one by one while reading: servers that send with blocking
+	// calls stall if their arrival notices are not consumed
+	for (int i = 0; i < self->connection_count; i++)
+	{
+		t_connection *connection = &self->connections[i];
+		struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = connection};
+		int one = 1;
+
+		connection->fd = connect_to_server();
+		setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		// With a ring the socket only carries what we send
+		if (config.ring)
+		{
+			struct epoll_event wake = {.events = EPOLLIN | EPOLLET, .data.ptr = connection};
+
+			open_ring(connection);
+			event.events = EPOLLOUT | EPOLLET;
+			if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, connection->ring_wake_fd, &wake) < 0)
+				fatal_error(NULL);
+		}
+		fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL) | O_NONBLOCK);
+		if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0)
+			fatal_error(NULL);
+		if (connection->ring)
+			receive_ring(self, connection);
+		if (connection->sender && (connection->pending = malloc(config.line_size)) == NULL)
+			fatal_error(NULL);
+		service_connections(self, 0, buffer);
+	}
+	__atomic_add_fetch(&connected_threads, 1, __ATOMIC_RELEASE);
+
+	while (current_phase() < PHASE_MEASURING)
+		service_connections(self, 10, buffer);
+
+	// Spread the senders' first lines over one interval
+	unsigned long start = now_ns();
+	for (int i = 0; i < self->connection_count; i++)
+		self->connections[i].next_send = start + (1000000000UL / config.rate) * i / self->connection_count;
+
+	while (current_phase() == PHASE_MEASURING)
+	{
+		unsigned long now = now_ns();
+
+		for (int i = 0; i < self->connection_count; i++)
+		{
+			if (self->connections[i].sender)
+				send_due_lines(self, &self->connections[i], now, line);
+		}
+		service_connections(self, 1, buffer);
+	}
+
+	while (current_phase() == PHASE_DRAINING)
+		service_connections(self, 10, buffer);
+
+	for (int i = 0; i < self->connection_count; i++)
+	{
+		t_connection *connection = &self->connections[i];
+
+		close(connection->fd);
+		free(connection->pending);
+		if (connection->ring)
+		{
+			munmap(connection->ring, RING_HEADER_SIZE + connection->ring->size);
+			close(connection->ring_wake_fd);
+			close(connection->ring_space_fd);
+		}
+	}
+	free(buffer);
+	free(line);
+	return NULL;
+}
+
+// Open and close extra connections at the configured rate while measuring
+void *churn_thread_main(void *argument)
+{
+	unsigned long interval = 1000000000UL / config.churn;
+	unsigned long next = now_ns();
+
+	(void)argument;
+	while (current_phase() == PHASE_MEASURING)
+	{
+		unsigned long now = now_ns();
+
+		if (now < next)
+		{
+			struct timespec pause = {0, next - now};
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		close(connect_to_server());
+		churn_cycles++;
+		next += interval;
+	}
+	return NULL;
+}
+
+// ============================================================================
+// REPORT
+// ============================================================================
+
+void print_report(double seconds)
+{
+	t_load_thread total;
+	unsigned long expected;
+
+	bzero(&total, sizeof(total));
+	for (int i = 0; i < config.threads; i++)
+	{
+		total.lines_sent += load_threads[i].lines_sent;
+		total.send_stalls += load_threads[i].send_stalls;
+		total.lines_received += load_threads[i].lines_received;
+		total.bytes_received += load_threads[i].bytes_received;
+		histogram_merge(&total.latency, &load_threads[i].latency);
+	}
+	expected = total.lines_sent * (config.connections - 1);
+
+	printf("connections %d, senders %d, threads %d, %ld lines/s of %ld bytes per sender, %.1f s\n",
+		   config.connections, config.senders, config.threads, config.rate, config.line_size, seconds);
+	printf("sent        %lu lines (%.0f/s), %lu send stalls\n",
+		   total.lines_sent, total.lines_sent / seconds, total.send_stalls);
+	printf("received    %lu lines (%.0f/s, %.1f MB/s), %.2f%% of expected\n",
+		   total.lines_received, total.lines_received / seconds, total.bytes_received / seconds / 1e6,
+		   expected ? 100.0 * total.lines_received / expected : 0.0);
+	printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+		   histogram_percentile(&total.latency, 50.0) / 1e3, histogram_percentile(&total.latency, 99.0) / 1e3,
+		   histogram_percentile(&total.latency, 99.9) / 1e3, total.latency.max / 1e3);
+	if (config.churn > 0)
+		printf("churn       %lu connect/close cycles (%.0f/s)\n", churn_cycles, churn_cycles / seconds);
+}
+
+// ============================================================================
+// MAIN PROGRAM
+// ============================================================================
+
+int main(int argc, char **argv)
+{
+	struct rlimit limit;
+	pthread_t churn_thread;
+	unsigned long start, stop;
+
+	if (argc != 2)
+		fatal_error("Wrong number of arguments\n");
+	load_config();
+	config.port = atoi(argv[1]);
+
+	// Thousands of connections need more than the default 1024 fds
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// Connection i goes to thread i % threads; the first ones are the senders
+	for (int i = 0; i < config.threads; i++)
+	{
+		t_load_thread *self = &load_threads[i];
+
+		self->connection_count = config.connections / config.threads + (i < config.connections % config.threads);
+		self->connections = calloc(self->connection_count, sizeof(t_connection));
+		self->epoll_fd = epoll_create1(0);
+		if (self->connections == NULL || self->epoll_fd < 0)
+			fatal_error(NULL);
+		for (int j = 0; j < self->connection_count; j++)
+			self->connections[j].sender = j * config.threads + i < config.senders;
+	}
+	for (int i = 0; i < config.threads; i++)
+	{
+		if (pthread_create(&load_threads[i].thread, NULL, load_thread_main, &load_threads[i]) != 0)
+			fatal_error(NULL);
+	}
+
+	while (__atomic_load_n(&connected_threads, __ATOMIC_ACQUIRE) < config.threads)
+		usleep(10000);
+	__atomic_store_n(&phase, PHASE_SETTLING, __ATOMIC_RELEASE);
+	usleep(SETTLE_USEC);
+
+	start = now_ns();
+	__atomic_store_n(&phase, PHASE_MEASURING, __ATOMIC_RELEASE);
+	if (config.churn > 0 && pthread_create(&churn_thread, NULL, churn_thread_main, NULL) != 0)
+		fatal_error(NULL);
+	sleep(config.duration);
+	__atomic_store_n(&phase, PHASE_DRAINING, __ATOMIC_RELEASE);
+	stop = now_ns();
+	if (config.churn > 0)
+		pthread_join(churn_thread, NULL);
+	usleep(GRACE_USEC);
+	__atomic_store_n(&phase, PHASE_DONE, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < config.threads; i++)
+		pthread_join(load_threads[i].thread, NULL);
+	print_report((stop - start) / 1e9);
+	return 0;
+}
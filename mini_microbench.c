@@ -0,0 +1,618 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#define MICRO_MAX_SWEEP 16		 // Values per swept list
+#define MICRO_MAX_RECIPIENTS 400 // Two fds each, and the exam servers use fd_set
+#define MICRO_SINK_BUFFER (4 << 20)
+#define MICRO_DRAIN_SIZE 262144
+
+// ============================================================================
+// ALLOCATION COUNTING
+// ============================================================================
+
+// Every malloc/calloc/realloc the servers below make is counted here
+unsigned long micro_allocations = 0;
+
+void *micro_malloc(size_t size)
+{
+	micro_allocations++;
+	return malloc(size);
+}
+
+void *micro_calloc(size_t count, size_t size)
+{
+	micro_allocations++;
+	return calloc(count, size);
+}
+
+void *micro_realloc(void *pointer, size_t size)
+{
+	micro_allocations++;
+	return realloc(pointer, size);
+}
+
+#define malloc micro_malloc
+#define calloc micro_calloc
+#define realloc micro_realloc
+
+// ============================================================================
+// SERVERS UNDER TEST
+// ============================================================================
+
+// The three servers are compiled in whole. The exam solutions share global
+// names with each other and with mini_serv_V2.c, so each gets its own prefix.
+#define s_client serv_s_client
+#define t_client serv_t_client
+#define clients serv_clients
+#define next_id serv_next_id
+#define read_fds serv_read_fds
+#define write_fds serv_write_fds
+#define master_fds serv_master_fds
+#define max_fd serv_max_fd
+#define server_fd serv_server_fd
+#define fatal_error serv_fatal_error
+#define safe_malloc serv_safe_malloc
+#define safe_realloc serv_safe_realloc
+#define add_client serv_add_client
+#define remove_client serv_remove_client
+#define find_client serv_find_client
+#define send_to_all_except serv_send_to_all_except
+#define send_to_all serv_send_to_all
+#define find_client_by_id serv_find_client_by_id
+#define notify_arrival serv_notify_arrival
+#define notify_departure serv_notify_departure
+#define handle_client_message serv_handle_client_message
+#define accept_new_client serv_accept_new_client
+#define main serv_main
+#include "mini_serv.c"
+#undef s_client
+#undef t_client
+#undef clients
+#undef next_id
+#undef read_fds
+#undef write_fds
+#undef master_fds
+#undef max_fd
+#undef server_fd
+#undef fatal_error
+#undef safe_malloc
+#undef safe_realloc
+#undef add_client
+#undef remove_client
+#undef find_client
+#undef send_to_all_except
+#undef send_to_all
+#undef find_client_by_id
+#undef notify_arrival
+#undef notify_departure
+#undef handle_client_message
+#undef accept_new_client
+#undef main
+
+#define s_client v1_s_client
+#define t_client v1_t_client
+#define ready_to_read v1_ready_to_read
+#define ready_to_write v1_ready_to_write
+#define all_sockets v1_all_sockets
+#define server_socket v1_server_socket
+#define highest_fd v1_highest_fd
+#define next_available_id v1_next_available_id
+#define client_array v1_client_array
+#define outgoing_message v1_outgoing_message
+#define incoming_data v1_incoming_data
+#define fatal_error v1_fatal_error
+#define broadcast_to_others v1_broadcast_to_others
+#define remove_client v1_remove_client
+#define get_complete_message v1_get_complete_message
+#define append_data v1_append_data
+#define main v1_main
+#include "mini_serv_V1.c"
+#undef s_client
+#undef t_client
+#undef ready_to_read
+#undef ready_to_write
+#undef all_sockets
+#undef server_socket
+#undef highest_fd
+#undef next_available_id
+#undef client_array
+#undef outgoing_message
+#undef incoming_data
+#undef fatal_error
+#undef broadcast_to_others
+#undef remove_client
+#undef get_complete_message
+#undef append_data
+#undef main
+
+#define main v2_main
+#include "mini_serv_V2.c"
+#undef main
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+// One point of the sweep and what was measured there
+typedef struct s_case
+{
+	long line_size;	 // Bytes per line, newline included
+	long lines;		 // Lines handed to the server per recv
+	long recipients; // Clients that get every line
+	unsigned long rounds;
+	unsigned long elapsed_ns;
+	unsigned long allocations;
+	unsigned long delivered; // Bytes the recipients received
+} t_case;
+
+// How one server is driven. feed() runs before each round untimed; round()
+// is the measured work: framing the batch and broadcasting every line.
+typedef struct s_target
+{
+	const char *name;
+	long max_line_size; // Longest line its fixed buffers format safely
+	long max_batch;		// Most bytes it accepts from one recv
+	int nonblocking;	// Server-side sockets must not block
+	void (*setup)(t_case *test);
+	void (*feed)(const char *batch, size_t length);
+	void (*round)(char *batch, size_t length);
+	void (*teardown)(t_case *test);
+} t_target;
+
+typedef struct s_micro_config
+{
+	long sizes[MICRO_MAX_SWEEP];
+	int size_count;
+	long batches[MICRO_MAX_SWEEP];
+	int batch_count;
+	long recipients[MICRO_MAX_SWEEP];
+	int recipient_count;
+	long time_ms; // Measured time per case
+	int csv;	  // One comma-separated row per case instead of a table
+	const char *servers;
+} t_micro_config;
+
+t_micro_config micro;
+
+// Socketpairs standing in for connections: index 0 is the sender, the rest
+// are recipients. The server writes to server_fds, we drain bench_fds.
+int server_fds[MICRO_MAX_RECIPIENTS + 1];
+int bench_fds[MICRO_MAX_RECIPIENTS + 1];
+int sink_count = 0;
+int sink_capacity = 0; // Bytes a server-side socket takes before it blocks
+char drain_buffer[MICRO_DRAIN_SIZE];
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+// Read a comma-separated list of integers from the environment, each within
+// [min, max]; config_number() and fatal_error() come from mini_serv_V2.c
+int config_list(const char *name, const char *default_value, long *values, long min, long max)
+{
+	const char *value = getenv(name);
+	char list[256];
+	char *item, *end;
+	int count = 0;
+
+	if (value == NULL)
+		value = default_value;
+	if (strlen(value) >= sizeof(list))
+		count = -1;
+	else
+		strcpy(list, value);
+	for (item = count < 0 ? NULL : strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+	{
+		long number = strtol(item, &end, 10);
+
+		if (*end != '\0' || number < min || number > max || count == MICRO_MAX_SWEEP)
+		{
+			count = -1;
+			break;
+		}
+		values[count++] = number;
+	}
+	if (count <= 0)
+	{
+		write(STDERR_FILENO, "Invalid ", 8);
+		fatal_error(name);
+	}
+	return count;
+}
+
+void load_micro_config(void)
+{
+	const char *format = getenv("MICRO_FORMAT");
+
+	micro.size_count = config_list("MICRO_SIZES", "16,128,1024", micro.sizes, 1, 1 << 20);
+	micro.batch_count = config_list("MICRO_LINES", "1,16,64", micro.batches, 1, 4096);
+	micro.recipient_count = config_list("MICRO_RECIPIENTS", "0,16,256", micro.recipients, 0, MICRO_MAX_RECIPIENTS);
+	micro.time_ms = config_number("MICRO_TIME_MS", 200, 1, 60000);
+	micro.servers = getenv("MICRO_SERVERS");
+	if (micro.servers == NULL)
+		micro.servers = "mini_serv,V1,V2";
+	if (format != NULL && strcmp(format, "csv") != 0 && strcmp(format, "table") != 0)
+		fatal_error("Invalid MICRO_FORMAT\n");
+	micro.csv = format != NULL && strcmp(format, "csv") == 0;
+}
+
+// Whether name is one of the comma-separated entries of MICRO_SERVERS
+int server_selected(const char *name)
+{
+	size_t length = strlen(name);
+
+	for (const char *entry = micro.servers; entry != NULL; entry = strchr(entry, ','))
+	{
+		if (*entry == ',')
+			entry++;
+		if (strncmp(entry, name, length) == 0 && (entry[length] == ',' || entry[length] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+// ============================================================================
+// SINKS
+// ============================================================================
+
+unsigned long now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+void open_sinks(int count, int nonblocking)
+{
+	int pair[2];
+	int size = MICRO_SINK_BUFFER;
+	socklen_t length = sizeof(sink_capacity);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+			fatal_error(NULL);
+		server_fds[i] = pair[0];
+		bench_fds[i] = pair[1];
+		// Unprivileged processes get at most net.core.wmem_max
+		setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		fcntl(pair[1], F_SETFL, O_NONBLOCK);
+		if (nonblocking)
+			fcntl(pair[0], F_SETFL, O_NONBLOCK);
+	}
+	getsockopt(server_fds[0], SOL_SOCKET, SO_SNDBUF, &sink_capacity, &length);
+	sink_count = count;
+}
+
+// Empty every recipient socket so the next round never blocks; returns the
+// bytes they had received
+unsigned long drain_sinks(void)
+{
+	unsigned long total = 0;
+	ssize_t received;
+
+	for (int i = 1; i < sink_count; i++)
+	{
+		while ((received = read(bench_fds[i], drain_buffer, sizeof(drain_buffer))) > 0)
+			total += received;
+	}
+	return total;
+}
+
+void close_sinks(void)
+{
+	for (int i = 0; i < sink_count; i++)
+	{
+		close(server_fds[i]);
+		close(bench_fds[i]);
+	}
+	sink_count = 0;
+}
+
+// ============================================================================
+// MINI_SERV.C
+// ============================================================================
+
+// handle_client_message() recv()s from the sender itself, so each batch is
+// written to the sender's socket first and read back 999 bytes at a time
+
+serv_t_client *serv_sender;
+
+void serv_setup(t_case *test)
+{
+	(void)test;
+	FD_ZERO(&serv_master_fds);
+	serv_next_id = 0;
+	for (int i = 0; i < sink_count; i++)
+		serv_add_client(server_fds[i]);
+	serv_sender = serv_find_client(server_fds[0]);
+}
+
+void serv_feed(const char *batch, size_t length)
+{
+	if (write(bench_fds[0], batch, length) != (ssize_t)length)
+		fatal_error(NULL);
+}
+
+void serv_round(char *batch, size_t length)
+{
+	int pending;
+
+	(void)batch;
+	(void)length;
+	while (ioctl(server_fds[0], FIONREAD, &pending) == 0 && pending > 0)
+		serv_handle_client_message(serv_sender);
+}
+
+// remove_client() would close the sockets, which close_sinks() owns
+void serv_teardown(t_case *test)
+{
+	(void)test;
+	while (serv_clients)
+	{
+		serv_t_client *next = serv_clients->next;
+
+		free(serv_clients->msg);
+		free(serv_clients);
+		serv_clients = next;
+	}
+}
+
+// ============================================================================
+// MINI_SERV_V1.C
+// ============================================================================
+
+// The body of V1's read branch: append_data(), then get_complete_message()
+// and broadcast_to_others() for every complete line
+
+void v1_setup(t_case *test)
+{
+	(void)test;
+	if (server_fds[0] >= 100)
+		fatal_error("V1 tracks at most 100 fds\n");
+	FD_ZERO(&v1_ready_to_write);
+	v1_server_socket = -1;
+	v1_highest_fd = server_fds[0];
+	for (int i = 1; i < sink_count; i++)
+	{
+		FD_SET(server_fds[i], &v1_ready_to_write);
+		if (server_fds[i] > v1_highest_fd)
+			v1_highest_fd = server_fds[i];
+	}
+	v1_client_array[server_fds[0]].client_id = 0;
+	v1_client_array[server_fds[0]].message_buffer = NULL;
+}
+
+void v1_round(char *batch, size_t length)
+{
+	int fd = server_fds[0];
+	char *complete_message = NULL;
+
+	(void)length;
+	v1_client_array[fd].message_buffer = v1_append_data(v1_client_array[fd].message_buffer, batch);
+	while (v1_get_complete_message(&v1_client_array[fd].message_buffer, &complete_message))
+	{
+		sprintf(v1_outgoing_message, "client %d: %s", v1_client_array[fd].client_id, complete_message);
+		v1_broadcast_to_others(fd, v1_outgoing_message);
+		free(complete_message);
+		complete_message = NULL;
+	}
+}
+
+void v1_teardown(t_case *test)
+{
+	(void)test;
+	free(v1_client_array[server_fds[0]].message_buffer);
+	v1_client_array[server_fds[0]].message_buffer = NULL;
+}
+
+// ============================================================================
+// MINI_SERV_V2.C
+// ============================================================================
+
+// frame_received_data() on the bytes of one recv, then the coalesced flush
+// that a select/epoll worker runs at the end of its loop iteration
+
+t_client *v2_clients[MICRO_MAX_RECIPIENTS + 1];
+
+// A single select worker on the calling thread, with no flush window, links,
+// history or rate limits; other MINI_SERV_* knobs apply as in the server
+void v2_init(void)
+{
+	load_config();
+	config.backend = BACKEND_SELECT;
+	config.worker_count = 1;
+	config.flush_window_usec = 0;
+	config.history_dir = NULL;
+	config.peer_count = 0;
+	config.rate_lines = 0;
+	config.rate_bytes = 0;
+	inbox_init(&workers[0].inbox);
+	workers[0].wake_fd = -1;
+	current_worker = &workers[0];
+}
+
+void v2_setup(t_case *test)
+{
+	(void)test;
+	for (int i = 0; i < sink_count; i++)
+		v2_clients[i] = register_client(server_fds[i], i, 0);
+}
+
+void v2_round(char *batch, size_t length)
+{
+	frame_received_data(v2_clients[0], batch, length);
+	flush_scheduled_clients();
+}
+
+void v2_teardown(t_case *test)
+{
+	(void)test;
+	for (int i = 0; i < sink_count; i++)
+	{
+		cleanup_client(v2_clients[i]);
+		v2_clients[i]->closing = 1;
+		client_record_release(v2_clients[i]);
+	}
+}
+
+// ============================================================================
+// MEASUREMENT
+// ============================================================================
+
+t_target targets[] = {
+	{"mini_serv", 1900, LONG_MAX, 0, serv_setup, serv_feed, serv_round, serv_teardown},
+	{"V1", 64000, 64999, 0, v1_setup, NULL, v1_round, v1_teardown},
+	{"V2", LONG_MAX, LONG_MAX, 1, v2_setup, NULL, v2_round, v2_teardown},
+};
+
+// Why a case cannot run on this server, NULL if it can
+const char *case_skip_reason(const t_target *target, const t_case *test)
+{
+	if (test->line_size > target->max_line_size)
+		return "line overflows its format buffer";
+	if (test->line_size * test->lines > target->max_batch)
+		return "batch exceeds its recv buffer";
+	// Each send() costs about a kilobyte of socket memory on top of its bytes
+	if (test->recipients > 0 && test->lines * (test->line_size + 1024) > sink_capacity / 2)
+		return "batch would fill a recipient socket";
+	return NULL;
+}
+
+// Rounds until micro.time_ms of measured time, after one untimed warm-up
+// round; only round() is timed, feeding and draining are not
+void run_case(const t_target *target, t_case *test)
+{
+	size_t length = test->line_size * test->lines;
+	char *batch = malloc(length + 1);
+	unsigned long start, allocations;
+
+	if (batch == NULL)
+		fatal_error(NULL);
+	for (long i = 0; i < test->lines; i++)
+	{
+		memset(batch + i * test->line_size, 'x', test->line_size - 1);
+		batch[(i + 1) * test->line_size - 1] = '\n';
+	}
+	batch[length] = '\0';
+
+	open_sinks(test->recipients + 1, target->nonblocking);
+	target->setup(test);
+	for (long warmup = 1; test->elapsed_ns < micro.time_ms * 1000000UL; warmup = 0)
+	{
+		if (target->feed)
+			target->feed(batch, length);
+		allocations = micro_allocations;
+		start = now_ns();
+		target->round(batch, length);
+		if (!warmup)
+		{
+			test->elapsed_ns += now_ns() - start;
+			test->allocations += micro_allocations - allocations;
+			test->rounds++;
+		}
+		test->delivered += drain_sinks();
+	}
+	target->teardown(test);
+	close_sinks();
+	free(batch);
+}
+
+void print_header(void)
+{
+	if (micro.csv)
+		printf("server,line_size,lines_per_recv,recipients,rounds,ns_per_line,bytes_per_second,allocs_per_line\n");
+	else
+		printf("%-10s %9s %6s %10s %12s %10s %12s\n", "server", "line", "lines", "recipients", "ns/line", "MB/s",
+			   "allocs/line");
+}
+
+// Per-line figures; bytes/s counts the lines read, not the fan-out written
+void print_case(const t_target *target, const t_case *test)
+{
+	double lines = (double)test->rounds * test->lines;
+	double ns_per_line = test->elapsed_ns / lines;
+	double bytes_per_second = lines * test->line_size / (test->elapsed_ns / 1e9);
+
+	if (micro.csv)
+		printf("%s,%ld,%ld,%ld,%lu,%.1f,%.0f,%.3f\n", target->name, test->line_size, test->lines, test->recipients,
+			   test->rounds, ns_per_line, bytes_per_second, test->allocations / lines);
+	else
+		printf("%-10s %9ld %6ld %10ld %12.1f %10.1f %12.3f\n", target->name, test->line_size, test->lines,
+			   test->recipients, ns_per_line, bytes_per_second / 1e6, test->allocations / lines);
+	fflush(stdout);
+}
+
+// ============================================================================
+// MAIN PROGRAM
+// ============================================================================
+
+int main(int argc, char **argv)
+{
+	(void)argv;
+	if (argc != 1)
+		fatal_error("Wrong number of arguments\n");
+	load_micro_config();
+	v2_init();
+	signal(SIGPIPE, SIG_IGN); // The exam servers send() without MSG_NOSIGNAL
+	open_sinks(1, 0);		  // Learn sink_capacity
+	close_sinks();
+
+	print_header();
+	for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++)
+	{
+		if (!server_selected(targets[t].name))
+			continue;
+		for (int s = 0; s < micro.size_count; s++)
+			for (int b = 0; b < micro.batch_count; b++)
+				for (int r = 0; r < micro.recipient_count; r++)
+				{
+					t_case test = {.line_size = micro.sizes[s],
+								   .lines = micro.batches[b],
+								   .recipients = micro.recipients[r]};
+					const char *reason;
+
+					if ((reason = case_skip_reason(&targets[t], &test)) != NULL)
+					{
+						fprintf(stderr, "skipped %s, %ld x %ld bytes to %ld: %s\n", targets[t].name, test.lines,
+								test.line_size, test.recipients, reason);
+						continue;
+					}
+					run_case(&targets[t], &test);
+					if (test.recipients > 0 && test.delivered == 0)
+						fprintf(stderr, "%s delivered nothing\n", targets[t].name);
+					print_case(&targets[t], &test);
+				}
+	}
+	return 0;
+}
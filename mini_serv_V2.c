@@ -1,241 +1,5831 @@
+#define _GNU_SOURCE // accept4()
 #include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 
-#define MAX_CLIENTS 100
 #define BUFFER_SIZE 65000
 #define LOCALHOST_IP 2130706433 // 127.0.0.1 in decimal
+#define MAX_EVENTS 256			// Ready events returned by one epoll_wait()
+#define FLUSH_IOVECS 64			// Queued messages handed to one sendmsg()
+#define PREFIX_SIZE 32			// Room for "client <id>: "
+#define INBOUND_KEEP 4096		// Larger idle inbound buffers are released
+#define OUTBOUND_KEEP 64		// Larger idle outbound rings are released
+#define CLIENT_SLAB_SIZE 256	// Client records allocated at a time
+#define MAX_WORKERS 64			// Upper bound for MINI_SERV_THREADS
+
+// Event loop backends, selected with MINI_SERV_BACKEND=select|epoll|io_uring
+#define BACKEND_SELECT 0
+#define BACKEND_EPOLL 1
+#define BACKEND_IO_URING 2
+#ifndef DEFAULT_BACKEND
+#define DEFAULT_BACKEND BACKEND_EPOLL
+#endif
+
+// What to do with a consumer whose backlog outgrows its limits, selected with
+// MINI_SERV_SLOW_POLICY=drop|disconnect|backpressure
+#define SLOW_DROP 0
+#define SLOW_DISCONNECT 1
+#define SLOW_BACKPRESSURE 2
+#define DEFAULT_CLIENT_QUEUE_MAX (8L << 20) // Backlog bytes one client may hold
+#define DEFAULT_QUEUE_BUDGET (256L << 20)	// Bytes of queued messages for the whole server
+
+// Connection admission: listeners queue up to MINI_SERV_BACKLOG connections,
+// and one wakeup accepts at most MINI_SERV_ACCEPT_BATCH of them
+#define DEFAULT_ACCEPT_BATCH 256
+
+// Read path fairness: a client gets MINI_SERV_READ_BUDGET bytes per turn, and
+// with MINI_SERV_RATE_LINES / MINI_SERV_RATE_BYTES set, token buckets holding
+// one second of each rate decide when its socket is read at all
+#define DEFAULT_READ_BUDGET (4 * BUFFER_SIZE)
+#define RATE_WAKEUPS_PER_SEC 100 // A throttled client waits for at least this share of a second's bytes
+
+// Cut-through streaming: a partial line that grows past
+// MINI_SERV_STREAM_THRESHOLD is broadcast as it arrives, one chunk per read,
+// the first with the sender's prefix, instead of being buffered whole. A
+// sender that sends nothing for MINI_SERV_STREAM_STALL_SEC has its line ended.
+#define DEFAULT_STREAM_THRESHOLD (1L << 20)
+#define DEFAULT_STREAM_STALL_SEC 10
+
+// Idle reaping, enabled with MINI_SERV_IDLE_SEC: every client's deadline sits
+// in a hierarchical timer wheel of WHEEL_LEVELS levels of WHEEL_SLOTS slots,
+// level n slots spanning WHEEL_SLOTS^n ticks, so inserting and cancelling
+// are O(1) and a tick only looks at the slot it expires
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4			 // 64^4 one-second ticks, about 194 days
+#define WHEEL_TICK_USEC 1000000L // Deadlines are rounded up to a whole tick
+
+// Presence batching, enabled with MINI_SERV_PRESENCE_BATCH=1: arrivals and
+// departures wait for the next flush, then each room gets one notice per run
+// of the same kind, "server: clients 3, 4, 5 just arrived"
+#define PRESENCE_ID_WIDTH 13 // ", -2147483648"
+
+// Rooms, enabled with MINI_SERV_ROOMS=1: "/join <name>" moves a client out of
+// the lobby, and from then on its lines and notices only reach that room
+#define ROOM_NAME_MAX 32 // Including the terminating NUL
+#define LOBBY_ROOM 0
+
+// Binary protocol, served on MINI_SERV_BINARY_PORT: every frame is a
+// t_frame_header followed by its payload
+#define FRAME_MESSAGE 1 // Payload is broadcast to the sender's room
+#define FRAME_ARRIVED 2 // Server to client only, no payload
+#define FRAME_LEFT 3	// Server to client only, no payload
+#define FRAME_JOIN 4	// Client to server, payload is a room name
+#define FRAME_HELLO 5	// Node link only, sender is the node id
+#define FRAME_BATCH 6	// Node link only, payload is a run of broadcast entries
+#define FRAME_STREAM 7	// Batch entry only, a piece of a streamed line, more follows
+#define FRAME_STREAM_END 8 // Batch entry only, the last piece, without the newline
+#define FRAME_MAX_PAYLOAD (16L << 20) // Larger frames disconnect the sender
+
+// Federation: nodes dial the MINI_SERV_PEERS ports of other nodes and accept
+// links on MINI_SERV_PEER_PORT; every broadcast reaches the other nodes over
+// those links, batched per flush. Client ids come from the node's own range.
+#define NODE_ID_RANGE 1000000	   // Client ids per node
+#define MAX_NODE_ID 2146		   // Keeps every client id below INT_MAX
+#define MAX_PEERS 64			   // Entries of MINI_SERV_PEERS
+#define LINK_BATCH_MAX (256 << 10) // A batch is sent once it holds this many bytes
+#define LINK_RETRY_SEC 1		   // Links that are down are dialed again this often
+
+// History log, enabled with MINI_SERV_HISTORY_DIR: broadcast lines are
+// appended to mapped segment files and can be replayed with "/replay"
+#define DEFAULT_HISTORY_SEGMENT (64L << 20) // Data bytes per segment
+#define DEFAULT_HISTORY_SEGMENTS 8			// Segments kept, older ones are deleted
+
+// Local clients, enabled with MINI_SERV_UNIX_PATH: a Unix socket speaking the
+// text protocol. On it, "/ring" moves the client's output to a shared memory
+// ring of MINI_SERV_RING_SIZE bytes, handed over with RING_READY.
+#define DEFAULT_RING_SIZE (1L << 20)
+#define RING_HEADER_SIZE 4096 // t_ring_header, padded to a page; the data follows
+#define RING_READY "server: ring ready\n" // Sent with the ring's memfd and eventfds attached
+#define RING_WAIT_FUTEX 1	  // consumer_waiting: wake the client through wake_sequence
+#define RING_WAIT_EVENTFD 2	  // consumer_waiting: wake the client through its eventfd
+
+// io_uring engine sizing (per worker)
+#define URING_ENTRIES 4096		// Submission queue slots
+#define URING_BUFFER_COUNT 512	// Provided receive buffers, power of two
+#define URING_BUFFER_SIZE 16384 // Bytes per provided receive buffer
+#define URING_BUFFER_GROUP 0
+
+// io_uring user_data tags, stored in the low bits of a (8-byte aligned) client pointer
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_WAKE 3
+#define URING_OP_FLUSH_TIMER 4
+#define URING_OP_CANCEL 5
+#define URING_OP_LINK_TIMER 6
+#define URING_OP_THROTTLE_TIMER 7
+#define URING_OP_MASK 7
+#define URING_ACCEPT_POLL 8 // Accept tag bit: a poll for the listener, waiting out the fd limit
+#define URING_TIMER_IDLE 8	// Flush timer tag bit: a poll on the idle timer instead
+
+// Bump a per-worker counter. Only the owning thread writes, so a relaxed
+// store is enough for the stats dump to read a consistent value.
+#define STAT_ADD(field, amount) \
+	__atomic_store_n(&current_worker->stats.field, current_worker->stats.field + (amount), __ATOMIC_RELAXED)
+#define STAT_MAX(field, value)                                           \
+	do                                                                   \
+	{                                                                    \
+		if ((unsigned long)(value) > current_worker->stats.field)        \
+			__atomic_store_n(&current_worker->stats.field, (value), __ATOMIC_RELAXED); \
+	} while (0)
+
+// Message pool: blocks of 64 B << class up to 64 KiB, each worker keeping up
+// to POOL_KEEP_BYTES of free blocks per class; larger messages use malloc
+#define POOL_CLASSES 11
+#define POOL_MIN_SHIFT 6
+#define POOL_KEEP_BYTES (1 << 20)
+
+// Event loop busy time histogram: bucket i counts iterations that took less
+// than 2^i microseconds of work, the last one everything slower
+#define LOOP_HISTOGRAM_BUCKETS 18
+
+// One entry per sequence number in a history segment's index file
+typedef struct s_history_entry
+{
+	uint64_t offset; // Where the line starts in the data file
+	uint32_t length; // 0 past the last entry written
+	int32_t room;
+} t_history_entry;
+
+// A segment of the history log: a data file holding broadcast lines back to
+// back and its index file, both mapped for as long as the segment is used
+typedef struct s_segment
+{
+	unsigned long first_sequence;
+	char *data;
+	t_history_entry *index;
+	size_t data_size;  // Bytes
+	size_t index_size; // Entries
+	size_t used;	   // Data bytes written
+	size_t count;	   // Entries written
+	int refcount;	   // The log plus every queued replay slice, updated atomically
+	struct s_segment *previous;
+	struct s_segment *next;
+} t_segment;
+
+// A segment a replay reads outside history_lock, and where its lines ended
+// when the replay started
+typedef struct s_replay_span
+{
+	t_segment *segment;
+	unsigned long end; // Sequence after its last line to replay
+} t_replay_span;
+
+// A formatted line shared by every recipient queue that still needs it,
+// possibly on several worker threads
+typedef struct s_message
+{
+	int refcount;	// Updated atomically
+	int size_class; // Message pool class, -1 when allocated with malloc
+	int owner;		// Worker whose pool the block returns to
+	int room;		// Only members of this room receive it
+	int remote;		// Came from another node, so it is not forwarded to links
+	struct s_message *binary; // The same broadcast framed for binary clients, owned by this one
+	unsigned long sequence;	  // Position in the history log, 0 if not logged
+	t_segment *segment;		  // Set for replay slices, whose bytes lie in its mapping
+	char *bytes;			  // What to send: data, or a slice of a segment
+	size_t length;
+	struct s_inbox_node *forward_nodes; // One per worker, to reach other inboxes
+	unsigned long stream;	  // Chunk of the streamed line started at this stream_clock, 0 = whole message
+	int stream_end;			  // Last chunk of that line, ends with the newline
+	int sender;				  // Client id behind a streamed chunk, for node links
+	char data[];
+} t_message;
+
+// Messages accepted for a client but not yet taken by the kernel
+typedef struct s_outbound
+{
+	t_message **entries; // Ring of message references, oldest at head
+	size_t head;
+	size_t count;
+	size_t capacity;	// Always a power of two
+	size_t head_offset; // Bytes of the head message already sent
+	size_t bytes;		// Unsent bytes across all entries
+} t_outbound;
+
+// Unterminated tail of a client's input, carried over between recv() calls.
+// For text clients it never contains '\n', so new data is the only part that
+// needs scanning; for binary clients it holds the start of one frame.
+typedef struct s_inbound
+{
+	char *data;
+	size_t length;
+	size_t capacity;
+} t_inbound;
+
+// A deadline in the timer wheel, embedded in whatever it times
+#define TIMER_IDLE 0   // A client's idle_timer
+#define TIMER_STREAM 1 // A client's stream_timer
+typedef struct s_timer
+{
+	struct s_timer *next;
+	struct s_timer **link;	// What points at this timer, NULL while not in the wheel
+	unsigned long expires;	// Tick it fires at
+	int level;
+	int slot;
+	int kind; // Which of its owner's timers this is
+} t_timer;
+
+typedef struct s_wheel
+{
+	t_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS]; // Unsorted lists
+	uint64_t occupied[WHEEL_LEVELS];		   // Bit per non-empty slot
+	unsigned long now;						   // Next tick to run, the ones before it are done
+	size_t count;
+} t_wheel;
+
+// Start of a client's ring mapping, shared with the client process. The
+// server writes bytes at tail and the client reads them at head; both only
+// ever grow, so tail - head bytes are unread. The client sets
+// consumer_waiting before it sleeps, the server producer_waiting when the
+// ring is full; whoever finds the other's flag set clears it and wakes it.
+typedef struct s_ring_header
+{
+	uint64_t size;			   // Data bytes, a power of two
+	uint64_t tail;			   // Bytes written, advanced by the server
+	uint32_t wake_sequence;	   // Futex word, bumped by every futex wakeup
+	uint32_t consumer_waiting; // RING_WAIT_FUTEX or RING_WAIT_EVENTFD while the client sleeps
+	uint32_t closed;		   // Set once the server dropped the client
+	char padding[64 - 2 * sizeof(uint64_t) - 3 * sizeof(uint32_t)]; // head gets a cache line of its own
+	uint64_t head;			   // Bytes read, advanced by the client
+	uint32_t producer_waiting; // The server waits for room, signal space_fd after reading
+} t_ring_header;
+
+// The server's side of a ring
+typedef struct s_ring
+{
+	t_ring_header *header; // Mapping of the memfd, data at RING_HEADER_SIZE
+	char *data;
+	size_t size;
+	uint64_t tail; // The server's own copy: the header's may be scribbled on
+	int memfd;	   // Sent with RING_READY, closed once it went out
+	int wake_fd;   // eventfd a client waiting with RING_WAIT_EVENTFD sleeps on
+	int space_fd;  // eventfd the client signals when it made room
+	int announced; // RING_READY went out, so output goes to the ring
+} t_ring;
 
 typedef struct s_client
 {
-	int client_id;
-	char *message_buffer;
-} t_client;
+	int fd;
+	int client_id;
+	size_t active_index;		// Position in registry.active
+	int room;					// Room id, LOBBY_ROOM until the client joins another
+	size_t room_index;			// Position in that room's member list
+	struct s_client *next_free; // Free-list link while the record is unused
+	int write_armed;			// Write readiness is being watched
+	int flush_scheduled;		// Already in flush_list for this iteration
+	int closing;				// Disconnected, waiting for io_uring requests to finish
+	int uring_inflight;			// io_uring requests still referencing this record
+	int send_in_flight;			// An io_uring sendmsg is outstanding
+	int evicted;				// Over its limits, disconnected by the next flush
+	int read_paused;			// Parked in paused_list until backpressure lifts
+	int read_carried;			// In carried_list (io_uring: carried_recvs): used up its read budget with input left
+	int throttled;				// In throttled_list: over its rate, its socket is not read
+	int recv_stopped;			// io_uring recv ended while throttled, re-armed once released
+	unsigned long uring_turn;	// io_uring: loop turn uring_turn_bytes were read in
+	size_t uring_turn_bytes;
+	double line_tokens;			// Token buckets, refilled from tokens_usec on; only
+	double byte_tokens;			// meaningful while a rate limit is configured
+	unsigned long tokens_usec;
+	unsigned long active_usec;	// Last read that returned data; with idle reaping,
+	t_timer idle_timer;			// checked when this timer fires
+	int binary;					// Speaks the framed protocol (connected to the binary port)
+	int local;					// Connected to the Unix socket, so it may ask for a ring
+	struct s_ring *ring;		// Set once the client asked for a ring, its output goes there
+	unsigned long arrival_sequence; // History sequence when it connected; earlier lines are only replayed
+	unsigned long arrival_batch;	// presence_batch its arrival notice is held in
+	unsigned long room_serial;		// stream_clock when it entered its room
+	unsigned long stream_out;		// Its own line being streamed, 0 = none
+	unsigned long stream_open;		// Streamed line being written to it, 0 = none
+	t_message **stream_held;		// Messages waiting for that line to end
+	size_t stream_held_count, stream_held_capacity;
+	size_t stream_held_bytes;		// Their bytes, which count towards its backlog
+	unsigned long stream_usec;		// Last chunk of its own streamed line; with a stall
+	t_timer stream_timer;			// timeout, checked when this timer fires
+	struct s_link *link;			// Set for a link to another node rather than a client
+	struct s_uring_send *uring_send;
+	t_inbound inbound;
+	t_outbound outbound;
+	char prefix[PREFIX_SIZE]; // "client <id>: ", formatted once on connect
+	size_t prefix_length;
+} t_client;
+
+// Every connected client, reachable in O(1) by fd or by id
+typedef struct s_registry
+{
+	t_client **by_fd; // Indexed by fd, grows with the highest fd seen
+	size_t fd_capacity;
+	t_client **active; // Dense array of connected clients, for fan-out
+	size_t active_count;
+	size_t active_capacity;
+	t_client **by_id;		// Open-addressing table keyed by client_id
+	size_t id_capacity;		// Power of two, kept at most half full
+	t_client *free_records; // Recycled records from the slabs
+} t_registry;
+
+// The members of one room that this worker owns, so fan-out costs O(members)
+typedef struct s_room
+{
+	t_client **members;
+	size_t count;
+	size_t capacity;
+} t_room;
+
+// A line the peer node is streaming, passed on here as a streamed line too
+typedef struct s_link_stream
+{
+	int sender;			  // Client id on the peer node
+	int room;			  // Room the line goes to
+	unsigned long stream; // This node's stream_clock for the line
+} t_link_stream;
+
+// A connection to another node. It is registered like a client so the event
+// loops and flush paths serve it, but it is in no room: broadcasts are
+// appended to batch and sent as one FRAME_BATCH per flush.
+typedef struct s_link
+{
+	t_client *client;
+	int node;		 // Peer node id, -1 until its hello arrives (or once superseded)
+	int peer_index;	 // MINI_SERV_PEERS entry this node dialed, -1 if the peer dialed
+	t_inbound batch; // Entries for the next FRAME_BATCH
+	t_link_stream *streams; // Lines the peer is in the middle of
+	size_t stream_count, stream_capacity;
+} t_link;
+
+// One record of a hot restart handover, sent over the Unix socket with the
+// record's fd (if any) attached and followed by its variable-length parts
+#define HANDOVER_LISTENER 1 // A worker's listening socket, worker -1 for the stats port
+#define HANDOVER_CLIENT 2	// A connection with its buffers and room name
+#define HANDOVER_END 3		// Carries next_client_id, nothing follows
+typedef struct s_handover_record
+{
+	int type;
+	int worker; // Worker that owned the socket
+	int binary; // Listener: 0 text, 1 binary, 2 node links, 3 Unix socket; client: binary protocol
+	int local;	// Client connected to the Unix socket
+	int client_id;
+	int next_client_id;
+	int worker_count;
+	unsigned long arrival_sequence;
+	size_t inbound_length;	// Unparsed input, as received
+	size_t outbound_length; // Output not yet taken by the kernel
+	size_t room_length;
+	int fd; // Filled in by the receiver
+	char *data; // Filled in by the receiver: inbound, outbound, then room name
+} t_handover_record;
+
+// Fixed frame header of the binary protocol, all fields in network byte order
+typedef struct s_frame_header
+{
+	uint32_t length; // Payload bytes following the header
+	uint16_t type;	 // FRAME_MESSAGE, FRAME_ARRIVED, FRAME_LEFT or FRAME_JOIN
+	uint16_t reserved;
+	uint32_t sender; // Client id; ignored in frames sent by clients
+} t_frame_header;
+
+// An arrival or departure held for the next batched notice
+typedef struct s_presence
+{
+	int type; // FRAME_ARRIVED or FRAME_LEFT
+	int client_id;
+	int room;
+	int remote;	  // Learned from another node, so not forwarded to links
+	size_t order; // Position in the batch, keeps the sort stable
+} t_presence;
+
+// Lock-free multi-producer single-consumer queue (Vyukov) of messages other
+// workers broadcast; only the owning worker pops
+typedef struct s_inbox_node
+{
+	struct s_inbox_node *next;
+	t_message *message;
+} t_inbox_node;
+
+typedef struct s_inbox
+{
+	t_inbox_node *head; // Producers append here
+	t_inbox_node *tail; // Consumer pops here
+	t_inbox_node stub;
+} t_inbox;
+
+// Counters a worker keeps about itself, summed by dump_stats(). Every field
+// is an unsigned long written only by the owning worker (see STAT_ADD).
+typedef struct s_stats
+{
+	unsigned long messages_in;	  // Complete lines received from clients
+	unsigned long stream_chunks;  // Pieces of oversized lines broadcast as they arrived
+	unsigned long stream_stalls;  // Streamed lines ended because their sender stopped sending
+	unsigned long bytes_in;		  // Bytes received from clients
+	unsigned long deliveries;	  // Messages queued to a recipient
+	unsigned long flush_calls;	  // sendmsg() calls made to flush outbound queues
+	unsigned long flush_messages; // Queued messages covered by those calls
+	unsigned long flush_bytes;	  // Bytes the kernel accepted from them
+	unsigned long short_writes;	  // Flushes the socket took only part of
+	unsigned long queued_messages; // Messages waiting in this worker's queues now
+	unsigned long queue_depth_max; // Deepest single client queue seen
+	unsigned long accepts;
+	unsigned long accept_sheds; // Connections closed unserved because the process ran out of fds
+	unsigned long departures;
+	unsigned long slow_drops; // Queued messages dropped by the slow-consumer policy
+	unsigned long slow_disconnects;
+	unsigned long read_pauses; // Times backpressure stopped reading from senders
+	unsigned long throttles;   // Times a client went over its rate limit
+	unsigned long idle_reaps;  // Clients disconnected for sending nothing for MINI_SERV_IDLE_SEC
+	unsigned long ring_fills;  // Flushes that found a client's ring full
+	unsigned long ring_wakeups; // Sleeping ring clients woken through their futex or eventfd
+	unsigned long room_joins;
+	unsigned long presence_notices; // Batched arrival/departure notices broadcast
+	unsigned long protocol_errors; // Binary clients disconnected for a malformed frame
+	unsigned long history_appends;
+	unsigned long history_replays;
+	unsigned long link_batches; // FRAME_BATCH frames queued to node links
+	unsigned long link_entries; // Broadcasts received from other nodes
+	unsigned long alloc_messages; // Messages that missed the pool and hit malloc
+	unsigned long pool_reuses;
+	unsigned long alloc_slabs;	 // Client record slabs
+	unsigned long alloc_buffers; // Queue, inbound and table growths
+	unsigned long loop_wakeups;
+	unsigned long empty_polls; // Busy polls that found nothing to do
+	unsigned long loop_busy_usec; // Time spent working, from wakeup to end of flush
+	unsigned long loop_busy_max_usec;
+	unsigned long loop_busy_buckets[LOOP_HISTOGRAM_BUCKETS];
+} t_stats;
+
+// One event loop thread and the connections it owns
+typedef struct s_worker
+{
+	pthread_t thread;
+	int wake_fd;	 // eventfd signalled when the inbox gets new messages
+	int wake_posted; // A wakeup is already pending, producers skip the write
+	t_inbox inbox;
+	void *returned_blocks[POOL_CLASSES]; // Pool blocks freed by other workers, pushed atomically
+	t_stats stats;
+} t_worker;
+
+// Memory an in-flight io_uring sendmsg points at
+typedef struct s_uring_send
+{
+	struct msghdr header;
+	struct iovec iov[FLUSH_IOVECS];
+	size_t bytes; // Total length of iov, to spot short writes
+	char control[CMSG_SPACE(3 * sizeof(int))]; // The fds sent with RING_READY
+} t_uring_send;
+
+// A raw io_uring instance: mapped rings plus the provided receive buffers
+typedef struct s_uring
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_local_tail; // SQEs filled in but not yet published
+	unsigned sq_entries;
+	struct io_uring_buf_ring *buffer_ring;
+	char *buffers;
+	unsigned short buffer_tail;
+} t_uring;
+
+typedef struct s_config
+{
+	int backend;	  // BACKEND_SELECT, BACKEND_EPOLL or BACKEND_IO_URING
+	int worker_count; // Event loop threads sharing the port
+	struct in_addr bind_address; // Address the client and link listeners bind
+	int backlog;				 // listen() backlog of those listeners
+	long accept_batch;			 // Connections accepted per listener per wakeup
+	long flush_window_usec; // Hold coalesced output this long before flushing, 0 = every iteration
+	int slow_policy;		// SLOW_DROP, SLOW_DISCONNECT or SLOW_BACKPRESSURE
+	long client_queue_max;	// Backlog bytes a client may hold before the policy applies
+	long queue_budget;		// Bytes all live messages together may use
+	long read_budget;		// Bytes read from one client before the next ready one gets a turn
+	long rate_lines;		// Lines (or frames) per second a client may send, 0 = unlimited
+	long rate_bytes;		// Bytes per second a client may send, 0 = unlimited
+	long stream_threshold;	// Partial line length that starts streaming, 0 = buffer whole lines
+	long stream_stall_usec; // End a streamed line whose sender sends nothing for this long, 0 = never
+	long idle_usec;			// Disconnect clients that send nothing for this long, 0 = never
+	long busy_poll_usec;	// Keep polling this long after the last event before blocking, 0 = always block
+	int cpus[MAX_WORKERS];	// CPU each worker is pinned to, from MINI_SERV_CPUS
+	int cpu_count;			// 0 = not pinned
+	int stats_port;			// Local port serving the stats dump, 0 = off
+	int rooms;				// Clients may "/join <name>", 0 = everyone shares the lobby
+	int presence_batch;		// Merge arrival/departure notices per iteration, 0 = one notice each
+	int binary_port;		// Port of the binary protocol listener, 0 = off
+	const char *unix_path;	// Path of the Unix socket listener, NULL = off
+	long ring_size;			// Data bytes of a shared memory ring, 0 = rings off
+	const char *history_dir; // Directory of the history log, NULL = off
+	long history_segment_size;
+	int history_segments;
+	int node_id;			 // Client ids start at node_id * NODE_ID_RANGE
+	int peer_port;			 // Port accepting links from other nodes, 0 = off
+	int peer_ports[MAX_PEERS]; // Nodes to dial, from MINI_SERV_PEERS
+	int peer_count;
+} t_config;
+
+// Shared state
+int next_client_id = 0; // Incremented atomically by every worker
+t_config config;
+t_worker workers[MAX_WORKERS];
+volatile sig_atomic_t stats_dump_requested = 0;
+volatile sig_atomic_t handover_requested = 0;
+long live_message_bytes = 0; // Bytes of every message still referenced, updated atomically
+int peer_counts[2];			 // Connected text and binary clients, updated atomically
+unsigned long stream_clock;	 // Orders streamed line starts against room entries, updated atomically
+
+// History log segments, oldest first, shared by every worker
+pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+t_segment *history_oldest, *history_newest;
+size_t history_segment_count;
+unsigned long history_next_sequence = 1; // Written under history_lock, read atomically
+
+// Node links, all served by worker 0
+t_link **links;
+size_t link_count, link_capacity;
+int links_up;				// Links past their hello, read atomically by every worker
+int peer_nodes[MAX_PEERS];	// Node id behind each MINI_SERV_PEERS entry, -1 until known
+int peer_socket = -1;		// Listener for links other nodes dial
+int link_timer_fd = -1;		// timerfd for dialing MINI_SERV_PEERS again
+
+// Listener on MINI_SERV_UNIX_PATH; one socket, watched by every worker
+int unix_socket = -1;
+
+// Hot restart: the old process writes its state to handover_fd, the new one
+// keeps what it read until each worker takes its own sockets back
+char server_path[PATH_MAX]; // Binary to exec, resolved at startup
+char **server_argv;
+int handover_fd = -1;
+int stats_listener = -1;
+pthread_mutex_t handover_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_barrier_t handover_barrier;
+t_handover_record *handed_records;
+size_t handed_count;
+
+// Room names, registered once and shared by every worker; ids are never reused
+pthread_mutex_t room_lock = PTHREAD_MUTEX_INITIALIZER;
+char (*room_names)[ROOM_NAME_MAX]; // Indexed by room id, entry 0 (the lobby) unused
+size_t room_count = 1, room_names_capacity;
+int *room_slots;		   // Open-addressing table of room id + 1 keyed by name, 0 = empty
+size_t room_slot_capacity; // Power of two, kept at most half full
+
+// Per-worker state: each event loop thread owns its own sockets and clients
+__thread fd_set read_set, write_set, master_set, master_write_set;
+__thread int server_socket = 0, highest_fd = 0;
+__thread int binary_socket = -1; // Listener of the binary protocol
+__thread int epoll_fd = -1;
+__thread t_worker *current_worker;
+__thread t_registry registry;
+__thread t_uring uring;
+__thread t_room *rooms; // Indexed by room id, grows with the highest id joined here
+__thread size_t room_capacity;
+
+// Clients with queued output to hand to the kernel at the end of the iteration
+__thread t_client **flush_list;
+__thread size_t flush_count, flush_capacity;
+__thread int flush_timer_fd = -1; // timerfd ending the flush window
+__thread int flush_timer_armed;
+__thread unsigned long wakeup_usec; // When the current iteration stopped waiting
+__thread unsigned long spin_since_usec; // Busy polling: when polls started coming back empty, 0 = they are not
+
+// Backpressure: while reads_paused, readable clients are parked instead of
+// read, and io_uring recv completions are held with their buffers
+__thread int reads_paused;
+__thread int handing_over; // Stopped serving, draining state for the new process
+__thread t_client **paused_list;
+__thread size_t paused_count, paused_capacity;
+__thread struct io_uring_cqe *held_recvs;
+__thread size_t held_count, held_capacity;
+
+// Fairness: readers that used their turn's budget with input left, served
+// again after the next round of events, and readers over their rate limit
+__thread t_client **carried_list;
+__thread size_t carried_count, carried_capacity;
+__thread t_client **throttled_list;
+__thread size_t throttled_count, throttled_capacity;
+// io_uring reads have no loop to stop: receive completions past a client's
+// budget are carried, with their buffers, like held_recvs. A sendmsg covers
+// FLUSH_IOVECS messages, so they are replayed once no recipient still has a
+// backlog its socket would take: its last send went out whole with more queued.
+__thread struct io_uring_cqe *carried_recvs;
+__thread size_t carried_recv_count, carried_recv_capacity;
+__thread unsigned long uring_turn; // Counts run_uring_iteration() calls
+__thread size_t uring_catching_up; // Such recipients in the last turn
+__thread int throttle_timer_fd = -1;   // timerfd set for the earliest throttled client
+__thread unsigned long throttle_timer_usec; // When it fires, 0 = disarmed
+
+// Idle and stream stall deadlines of this worker's clients, and the timerfd
+// set for the next tick of the wheel that has work
+__thread t_wheel timer_wheel;
+__thread int idle_timer_fd = -1;
+__thread unsigned long idle_timer_tick; // Tick it is set for, 0 = disarmed
+
+// Arrivals and departures held for the next flush. presence_batch
+// numbers the batches, so a client can tell whether its arrival is still held.
+__thread t_presence *presence_events;
+__thread size_t presence_count, presence_capacity;
+__thread size_t presence_remote_count;
+__thread unsigned long presence_batch = 1;
+
+// Admission: listeners that still had connections queued when their batch
+// ran out, and a spare fd given up to shed a connection at the fd limit
+__thread int carried_listeners[4];
+__thread int carried_listener_count;
+__thread int reserve_fd = -1;
+
+__thread char receive_buffer[BUFFER_SIZE];
+
+// Free message blocks by size class, linked through their first word
+__thread void *message_pool[POOL_CLASSES];
+__thread size_t message_pool_count[POOL_CLASSES];
+
+// Defined with the io_uring backend and the rings below, needed earlier by
+// the flush path, node links and rings
+void uring_arm_send(t_client *client);
+void uring_arm_recv(t_client *client);
+void uring_arm_ring(t_client *client);
+void uring_arm_ring_ready(t_client *client, int *fds);
+void uring_cancel(unsigned long long user_data);
+void ring_flush(t_client *client);
+
+// Defined with the streamed lines and link batches below, needed earlier
+// when the timer wheel ends a stalled line and when a link closes
+void stream_chunk(t_client *sender, const char *data, size_t length, int last);
+void broadcast_link_stream(t_link *link, int type, int sender_id, int room, const char *payload, size_t length);
+
+// ============================================================================
+// ERROR HANDLING
+// ============================================================================
+
+void fatal_error(const char *error_message)
+{
+	if (error_message)
+		write(STDERR_FILENO, error_message, strlen(error_message));
+	else
+		write(STDERR_FILENO, "Fatal error\n", 12);
+	exit(1);
+}
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+// Read an integer knob from the environment, rejecting values outside [min, max]
+long config_number(const char *name, long default_value, long min, long max)
+{
+	const char *value = getenv(name);
+	char *end;
+	long number;
+
+	if (value == NULL)
+		return default_value;
+	number = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || number < min || number > max)
+	{
+		write(STDERR_FILENO, "Invalid ", 8);
+		fatal_error(name);
+	}
+	return number;
+}
+
+void load_config(void)
+{
+	const char *backend = getenv("MINI_SERV_BACKEND");
+
+	config.backend = DEFAULT_BACKEND;
+	if (backend && strcmp(backend, "select") == 0)
+		config.backend = BACKEND_SELECT;
+	else if (backend && strcmp(backend, "epoll") == 0)
+		config.backend = BACKEND_EPOLL;
+	else if (backend && strcmp(backend, "io_uring") == 0)
+		config.backend = BACKEND_IO_URING;
+	else if (backend)
+		fatal_error("Unknown MINI_SERV_BACKEND\n");
+
+	config.worker_count = config_number("MINI_SERV_THREADS", 1, 1, MAX_WORKERS);
+	config.flush_window_usec = config_number("MINI_SERV_FLUSH_USEC", 0, 0, 1000000);
+
+	const char *bind_address = getenv("MINI_SERV_BIND");
+
+	config.bind_address.s_addr = htonl(LOCALHOST_IP);
+	if (bind_address && inet_pton(AF_INET, bind_address, &config.bind_address) != 1)
+		fatal_error("Invalid MINI_SERV_BIND\n");
+	config.backlog = config_number("MINI_SERV_BACKLOG", SOMAXCONN, 1, 65535);
+	config.accept_batch = config_number("MINI_SERV_ACCEPT_BATCH", DEFAULT_ACCEPT_BATCH, 1, 1L << 20);
+
+	const char *policy = getenv("MINI_SERV_SLOW_POLICY");
+
+	config.slow_policy = SLOW_DISCONNECT;
+	if (policy && strcmp(policy, "drop") == 0)
+		config.slow_policy = SLOW_DROP;
+	else if (policy && strcmp(policy, "backpressure") == 0)
+		config.slow_policy = SLOW_BACKPRESSURE;
+	else if (policy && strcmp(policy, "disconnect") != 0)
+		fatal_error("Unknown MINI_SERV_SLOW_POLICY\n");
+	config.client_queue_max = config_number("MINI_SERV_CLIENT_QUEUE_MAX", DEFAULT_CLIENT_QUEUE_MAX,
+											BUFFER_SIZE, 1L << 40);
+	config.queue_budget = config_number("MINI_SERV_QUEUE_BUDGET", DEFAULT_QUEUE_BUDGET,
+										BUFFER_SIZE, 1L << 44);
+	config.read_budget = config_number("MINI_SERV_READ_BUDGET", DEFAULT_READ_BUDGET, BUFFER_SIZE, 1L << 30);
+	config.rate_lines = config_number("MINI_SERV_RATE_LINES", 0, 0, 1000000000);
+	config.rate_bytes = config_number("MINI_SERV_RATE_BYTES", 0, 0, 1L << 40);
+	config.stream_threshold = config_number("MINI_SERV_STREAM_THRESHOLD", DEFAULT_STREAM_THRESHOLD, 0, 1L << 40);
+	config.stream_stall_usec = config_number("MINI_SERV_STREAM_STALL_SEC", DEFAULT_STREAM_STALL_SEC, 0, 10000000) * 1000000L;
+	if (config.stream_threshold == 0)
+		config.stream_stall_usec = 0; // Nothing is ever streamed
+	config.idle_usec = config_number("MINI_SERV_IDLE_SEC", 0, 0, 10000000) * 1000000L;
+	config.busy_poll_usec = config_number("MINI_SERV_BUSY_POLL_USEC", 0, 0, 10000000);
+	config.stats_port = config_number("MINI_SERV_STATS_PORT", 0, 0, 65535);
+	config.rooms = config_number("MINI_SERV_ROOMS", 0, 0, 1);
+	config.presence_batch = config_number("MINI_SERV_PRESENCE_BATCH", 0, 0, 1);
+	config.binary_port = config_number("MINI_SERV_BINARY_PORT", 0, 0, 65535);
+	config.unix_path = getenv("MINI_SERV_UNIX_PATH");
+	if (config.unix_path && *config.unix_path == '\0')
+		config.unix_path = NULL;
+	if (config.unix_path && strlen(config.unix_path) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+		fatal_error("Invalid MINI_SERV_UNIX_PATH\n");
+	config.ring_size = config_number("MINI_SERV_RING_SIZE", DEFAULT_RING_SIZE, 0, 1L << 30);
+	if (config.ring_size != 0 && (config.ring_size < 4096 || (config.ring_size & (config.ring_size - 1))))
+		fatal_error("Invalid MINI_SERV_RING_SIZE\n");
+	config.history_dir = getenv("MINI_SERV_HISTORY_DIR");
+	if (config.history_dir && *config.history_dir == '\0')
+		config.history_dir = NULL;
+	config.history_segment_size = config_number("MINI_SERV_HISTORY_SEGMENT", DEFAULT_HISTORY_SEGMENT,
+												1L << 20, 1L << 30);
+	config.history_segments = config_number("MINI_SERV_HISTORY_SEGMENTS", DEFAULT_HISTORY_SEGMENTS, 2, 65536);
+	config.node_id = config_number("MINI_SERV_NODE_ID", 0, 0, MAX_NODE_ID);
+	config.peer_port = config_number("MINI_SERV_PEER_PORT", 0, 0, 65535);
+
+	// MINI_SERV_PEERS is a comma-separated list of ports on this host
+	const char *peers = getenv("MINI_SERV_PEERS");
+
+	for (config.peer_count = 0; peers && *peers; config.peer_count++)
+	{
+		char *end;
+		long peer_port = strtol(peers, &end, 10);
+
+		if (end == peers || (*end != ',' && *end != '\0') || peer_port < 1 || peer_port > 65535 ||
+			config.peer_count == MAX_PEERS)
+			fatal_error("Invalid MINI_SERV_PEERS\n");
+		config.peer_ports[config.peer_count] = peer_port;
+		peer_nodes[config.peer_count] = -1;
+		peers = *end ? end + 1 : end;
+	}
+
+	// MINI_SERV_CPUS is a comma-separated list of CPUs, taken by the workers in turn
+	const char *cpus = getenv("MINI_SERV_CPUS");
+
+	for (config.cpu_count = 0; cpus && *cpus; config.cpu_count++)
+	{
+		char *end;
+		long cpu = strtol(cpus, &end, 10);
+
+		if (end == cpus || (*end != ',' && *end != '\0') || cpu < 0 || cpu >= CPU_SETSIZE ||
+			config.cpu_count == MAX_WORKERS)
+			fatal_error("Invalid MINI_SERV_CPUS\n");
+		config.cpus[config.cpu_count] = cpu;
+		cpus = *end ? end + 1 : end;
+	}
+}
+
+// ============================================================================
+// STATISTICS
+// ============================================================================
+
+unsigned long monotonic_usec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+// The event loop returned from waiting: its busy time starts now
+void mark_wakeup(void)
+{
+	wakeup_usec = monotonic_usec();
+	STAT_ADD(loop_wakeups, 1);
+}
+
+// End of an iteration's work, coalesced flush included
+void record_loop_busy_time(void)
+{
+	unsigned long busy_usec = monotonic_usec() - wakeup_usec;
+	int bucket = busy_usec ? 64 - __builtin_clzl(busy_usec) : 0;
+
+	if (bucket >= LOOP_HISTOGRAM_BUCKETS)
+		bucket = LOOP_HISTOGRAM_BUCKETS - 1;
+	STAT_ADD(loop_busy_usec, busy_usec);
+	STAT_ADD(loop_busy_buckets[bucket], 1);
+	STAT_MAX(loop_busy_max_usec, busy_usec);
+}
+
+void request_stats_dump(int signal_number)
+{
+	(void)signal_number;
+	stats_dump_requested = 1;
+}
+
+void request_handover(int signal_number)
+{
+	(void)signal_number;
+	handover_requested = 1;
+}
+
+// Everything dump_stats() reports from t_stats, in order
+typedef struct s_stat_field
+{
+	const char *name;
+	const char *type; // "counter", or "gauge" for values that go down
+	size_t offset;
+	int take_max; // Combine workers with max() instead of a sum
+} t_stat_field;
+
+t_stat_field stat_fields[] = {
+	{"mini_serv_messages_in", "counter", offsetof(t_stats, messages_in), 0},
+	{"mini_serv_stream_chunks", "counter", offsetof(t_stats, stream_chunks), 0},
+	{"mini_serv_stream_stalls", "counter", offsetof(t_stats, stream_stalls), 0},
+	{"mini_serv_bytes_in", "counter", offsetof(t_stats, bytes_in), 0},
+	{"mini_serv_deliveries", "counter", offsetof(t_stats, deliveries), 0},
+	{"mini_serv_flush_calls", "counter", offsetof(t_stats, flush_calls), 0},
+	{"mini_serv_flush_messages", "counter", offsetof(t_stats, flush_messages), 0},
+	{"mini_serv_flush_bytes", "counter", offsetof(t_stats, flush_bytes), 0},
+	{"mini_serv_short_writes", "counter", offsetof(t_stats, short_writes), 0},
+	{"mini_serv_queued_messages", "gauge", offsetof(t_stats, queued_messages), 0},
+	{"mini_serv_queue_depth_max", "gauge", offsetof(t_stats, queue_depth_max), 1},
+	{"mini_serv_accepts", "counter", offsetof(t_stats, accepts), 0},
+	{"mini_serv_accept_sheds", "counter", offsetof(t_stats, accept_sheds), 0},
+	{"mini_serv_departures", "counter", offsetof(t_stats, departures), 0},
+	{"mini_serv_slow_drops", "counter", offsetof(t_stats, slow_drops), 0},
+	{"mini_serv_slow_disconnects", "counter", offsetof(t_stats, slow_disconnects), 0},
+	{"mini_serv_read_pauses", "counter", offsetof(t_stats, read_pauses), 0},
+	{"mini_serv_throttles", "counter", offsetof(t_stats, throttles), 0},
+	{"mini_serv_idle_reaps", "counter", offsetof(t_stats, idle_reaps), 0},
+	{"mini_serv_ring_fills", "counter", offsetof(t_stats, ring_fills), 0},
+	{"mini_serv_ring_wakeups", "counter", offsetof(t_stats, ring_wakeups), 0},
+	{"mini_serv_room_joins", "counter", offsetof(t_stats, room_joins), 0},
+	{"mini_serv_presence_notices", "counter", offsetof(t_stats, presence_notices), 0},
+	{"mini_serv_protocol_errors", "counter", offsetof(t_stats, protocol_errors), 0},
+	{"mini_serv_history_appends", "counter", offsetof(t_stats, history_appends), 0},
+	{"mini_serv_history_replays", "counter", offsetof(t_stats, history_replays), 0},
+	{"mini_serv_link_batches", "counter", offsetof(t_stats, link_batches), 0},
+	{"mini_serv_link_entries", "counter", offsetof(t_stats, link_entries), 0},
+	{"mini_serv_alloc_messages", "counter", offsetof(t_stats, alloc_messages), 0},
+	{"mini_serv_pool_reuses", "counter", offsetof(t_stats, pool_reuses), 0},
+	{"mini_serv_alloc_slabs", "counter", offsetof(t_stats, alloc_slabs), 0},
+	{"mini_serv_alloc_buffers", "counter", offsetof(t_stats, alloc_buffers), 0},
+	{"mini_serv_loop_wakeups", "counter", offsetof(t_stats, loop_wakeups), 0},
+	{"mini_serv_empty_polls", "counter", offsetof(t_stats, empty_polls), 0},
+	{"mini_serv_loop_busy_usec", "counter", offsetof(t_stats, loop_busy_usec), 0},
+	{"mini_serv_loop_busy_max_usec", "gauge", offsetof(t_stats, loop_busy_max_usec), 1},
+};
+
+unsigned long stat_value(int worker, size_t offset)
+{
+	return __atomic_load_n((unsigned long *)((char *)&workers[worker].stats + offset), __ATOMIC_RELAXED);
+}
+
+// snprintf() returns what it would have written: stop at the end of text
+size_t stats_clamp(size_t length, size_t size)
+{
+	return length < size ? length : size - 1;
+}
+
+// Format every counter, combined over the workers, in the Prometheus text
+// format. Returns the text length; output past size is cut off.
+size_t format_stats(char *text, size_t size)
+{
+	size_t length = 0;
+	unsigned long flush_calls = 0, flush_messages = 0, busy_usec = 0, cumulative = 0;
+
+	for (size_t f = 0; f < sizeof(stat_fields) / sizeof(stat_fields[0]); f++)
+	{
+		unsigned long value = 0;
+
+		for (int i = 0; i < config.worker_count; i++)
+		{
+			unsigned long worker_value = stat_value(i, stat_fields[f].offset);
+
+			if (!stat_fields[f].take_max)
+				value += worker_value;
+			else if (worker_value > value)
+				value = worker_value;
+		}
+		if (stat_fields[f].offset == offsetof(t_stats, flush_calls))
+			flush_calls = value;
+		if (stat_fields[f].offset == offsetof(t_stats, flush_messages))
+			flush_messages = value;
+		if (stat_fields[f].offset == offsetof(t_stats, loop_busy_usec))
+			busy_usec = value;
+		length = stats_clamp(length + snprintf(text + length, size - length, "# TYPE %s %s\n%s %lu\n",
+						   stat_fields[f].name, stat_fields[f].type, stat_fields[f].name, value), size);
+	}
+	length = stats_clamp(length + snprintf(text + length, size - length,
+					   "# TYPE mini_serv_flush_batch_avg gauge\nmini_serv_flush_batch_avg %.2f\n"
+					   "# TYPE mini_serv_queued_bytes gauge\nmini_serv_queued_bytes %ld\n"
+					   "# TYPE mini_serv_loop_busy_usec_hist histogram\n",
+					   flush_calls ? (double)flush_messages / flush_calls : 0.0,
+					   __atomic_load_n(&live_message_bytes, __ATOMIC_RELAXED)), size);
+	for (int b = 0; b < LOOP_HISTOGRAM_BUCKETS; b++)
+	{
+		for (int i = 0; i < config.worker_count; i++)
+			cumulative += stat_value(i, offsetof(t_stats, loop_busy_buckets) + b * sizeof(unsigned long));
+		if (b < LOOP_HISTOGRAM_BUCKETS - 1)
+			length = stats_clamp(length + snprintf(text + length, size - length, "mini_serv_loop_busy_usec_hist_bucket{le=\"%lu\"} %lu\n",
+							   1UL << b, cumulative), size);
+		else
+			length = stats_clamp(length + snprintf(text + length, size - length,
+							   "mini_serv_loop_busy_usec_hist_bucket{le=\"+Inf\"} %lu\n"
+							   "mini_serv_loop_busy_usec_hist_sum %lu\nmini_serv_loop_busy_usec_hist_count %lu\n",
+							   cumulative, busy_usec, cumulative), size);
+	}
+	return length;
+}
+
+void dump_stats(int fd)
+{
+	char text[16384];
+	size_t length = format_stats(text, sizeof(text));
+	size_t written = 0;
+
+	while (written < length)
+	{
+		ssize_t result = write(fd, text + written, length - written);
+
+		if (result <= 0)
+			return;
+		written += result;
+	}
+}
+
+// Serve one dump per connection on MINI_SERV_STATS_PORT, from its own thread
+// so the event loops never see the scrapers
+void *stats_server_main(void *argument)
+{
+	int listener = (intptr_t)argument;
+
+	while (1)
+	{
+		int fd = accept(listener, NULL, NULL);
+
+		if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		if (fd < 0)
+		{
+			// Out of fds, most likely: the connection stays queued, so wait
+			// for some to be freed instead of failing again at once
+			usleep(100000);
+			continue;
+		}
+		dump_stats(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+// listener is the socket a hot restart handed over, or -1 to open one
+void start_stats_server(int listener)
+{
+	struct sockaddr_in address;
+	pthread_t thread;
+	int one = 1;
+
+	if (listener < 0)
+	{
+		listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listener < 0)
+			fatal_error(NULL);
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		bzero(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(LOCALHOST_IP);
+		address.sin_port = htons(config.stats_port);
+		if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 10) < 0)
+			fatal_error(NULL);
+	}
+	stats_listener = listener;
+	if (pthread_create(&thread, NULL, stats_server_main, (void *)(intptr_t)listener) != 0)
+		fatal_error(NULL);
+	pthread_detach(thread);
+}
+
+// ============================================================================
+// EVENT LOOP
+// ============================================================================
+
+void set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		fatal_error(NULL);
+}
+
+// The io_uring engine arms its own requests, these only serve select and epoll
+void event_init(void)
+{
+	if (config.backend == BACKEND_EPOLL)
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			fatal_error(NULL);
+	}
+	FD_ZERO(&master_set);
+	FD_ZERO(&master_write_set);
+	highest_fd = 0;
+}
+
+// Start watching fd for input. Returns -1 if the backend cannot track it.
+int event_add(int fd)
+{
+	if (config.backend == BACKEND_IO_URING)
+		return 0;
+	if (config.backend == BACKEND_EPOLL)
+	{
+		// Edge-triggered: readers must drain the socket until EAGAIN
+		struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.fd = fd};
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+			return -1;
+	}
+	else
+	{
+		if (fd >= FD_SETSIZE) // select() cannot watch this fd
+			return -1;
+		FD_SET(fd, &master_set);
+	}
+
+	if (fd > highest_fd)
+		highest_fd = fd;
+	return 0;
+}
+
+// Watch (or stop watching) fd for write readiness, input stays watched
+void event_watch_writable(int fd, int enable)
+{
+	if (config.backend == BACKEND_IO_URING)
+		return;
+	if (config.backend == BACKEND_EPOLL)
+	{
+		struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.fd = fd};
+		if (enable)
+			event.events |= EPOLLOUT;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+	}
+	else if (enable)
+		FD_SET(fd, &master_write_set);
+	else
+		FD_CLR(fd, &master_write_set);
+}
+
+void event_remove(int fd)
+{
+	if (config.backend == BACKEND_IO_URING)
+		return;
+	if (config.backend == BACKEND_EPOLL)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	else
+	{
+		FD_CLR(fd, &master_set);
+		FD_CLR(fd, &master_write_set);
+	}
+}
+
+// ============================================================================
+// BUSY POLLING
+// ============================================================================
+
+// With MINI_SERV_BUSY_POLL_USEC, the loop polls without a timeout and only
+// blocks once polls have come back empty for that long
+int busy_poll_spinning(void)
+{
+	if (config.busy_poll_usec == 0)
+		return 0;
+	return spin_since_usec == 0 || monotonic_usec() - spin_since_usec < (unsigned long)config.busy_poll_usec;
+}
+
+// Carried readers and listeners are work too, so they keep the spin going
+void busy_poll_result(int found)
+{
+	if (config.busy_poll_usec == 0)
+		return;
+	if (found || carried_count + carried_listener_count > 0)
+		spin_since_usec = 0;
+	else
+	{
+		if (spin_since_usec == 0)
+			spin_since_usec = wakeup_usec;
+		STAT_ADD(empty_polls, 1);
+	}
+}
+
+// Keep this worker on its MINI_SERV_CPUS entry
+void pin_worker(void)
+{
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(config.cpus[(current_worker - workers) % config.cpu_count], &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		fatal_error("Cannot pin to MINI_SERV_CPUS\n");
+}
+
+// Busy polling: fault every page in now, and every later one as it is
+// mapped, and keep them resident so the loop never waits on a page fault.
+// Skipped when RLIMIT_MEMLOCK would make later allocations fail instead.
+void lock_memory(void)
+{
+	struct rlimit limit;
+
+	if (geteuid() != 0 && (getrlimit(RLIMIT_MEMLOCK, &limit) < 0 || limit.rlim_cur != RLIM_INFINITY))
+		write(STDERR_FILENO, "RLIMIT_MEMLOCK is limited, memory not locked\n", 45);
+	else if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		write(STDERR_FILENO, "mlockall failed, memory not locked\n", 35);
+}
+
+// ============================================================================
+// MESSAGE POOL
+// ============================================================================
+
+// Smallest class whose blocks hold size bytes, -1 if none does
+int pool_class(size_t size)
+{
+	int size_class = size <= (1UL << POOL_MIN_SHIFT) ? 0 : 64 - __builtin_clzl(size - 1) - POOL_MIN_SHIFT;
+
+	return size_class < POOL_CLASSES ? size_class : -1;
+}
+
+void *pool_alloc(int size_class, size_t size)
+{
+	void *block = size_class >= 0 ? message_pool[size_class] : NULL;
+
+	// Local list empty: take back everything other workers returned at once
+	if (block == NULL && size_class >= 0 && current_worker->returned_blocks[size_class])
+	{
+		block = __atomic_exchange_n(&current_worker->returned_blocks[size_class], NULL, __ATOMIC_ACQUIRE);
+		message_pool[size_class] = block;
+		for (void *counted = block; counted; counted = *(void **)counted)
+			message_pool_count[size_class]++;
+	}
+	if (block)
+	{
+		message_pool[size_class] = *(void **)block;
+		message_pool_count[size_class]--;
+		STAT_ADD(pool_reuses, 1);
+		return block;
+	}
+	block = malloc(size_class >= 0 ? 1UL << (size_class + POOL_MIN_SHIFT) : size);
+	if (block == NULL)
+		fatal_error(NULL);
+	STAT_ADD(alloc_messages, 1);
+	return block;
+}
+
+// Blocks go back to the worker that allocated them, so one-way traffic
+// between workers does not leave one side allocating and the other freeing
+void pool_free(void *block, int size_class, int owner)
+{
+	size_t keep;
+
+	if (size_class < 0)
+	{
+		free(block);
+		return;
+	}
+	if (&workers[owner] != current_worker)
+	{
+		void **stack = &workers[owner].returned_blocks[size_class];
+		void *head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+
+		// The owner only ever takes the whole stack, so there is no ABA
+		do
+			*(void **)block = head;
+		while (!__atomic_compare_exchange_n(stack, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return;
+	}
+	keep = POOL_KEEP_BYTES >> (size_class + POOL_MIN_SHIFT);
+	if (message_pool_count[size_class] >= (keep > 16 ? keep : 16))
+	{
+		free(block);
+		return;
+	}
+	*(void **)block = message_pool[size_class];
+	message_pool[size_class] = block;
+	message_pool_count[size_class]++;
+}
+
+// ============================================================================
+// SHARED MESSAGES
+// ============================================================================
+
+// Build a message once as prefix + payload; the caller owns the first reference.
+// A NULL payload leaves payload_length bytes for the caller to fill in. In
+// threaded mode the inbox nodes that carry it to other workers come in the
+// same block, after the data.
+t_message *message_create(const char *prefix, size_t prefix_length,
+						  const char *payload, size_t payload_length)
+{
+	size_t length = prefix_length + payload_length;
+	size_t nodes_offset = (sizeof(t_message) + length + 7) & ~(size_t)7;
+	size_t size = nodes_offset;
+	t_message *message;
+	int size_class;
+
+	if (config.worker_count > 1)
+		size += config.worker_count * sizeof(struct s_inbox_node);
+	size_class = pool_class(size);
+	message = pool_alloc(size_class, size);
+	message->refcount = 1;
+	message->size_class = size_class;
+	message->owner = current_worker - workers;
+	message->room = LOBBY_ROOM;
+	message->remote = 0;
+	message->binary = NULL;
+	message->sequence = 0;
+	message->segment = NULL;
+	message->stream = 0;
+	message->stream_end = 0;
+	message->sender = 0;
+	message->bytes = message->data;
+	message->length = length;
+	message->forward_nodes = config.worker_count > 1 ? (struct s_inbox_node *)((char *)message + nodes_offset) : NULL;
+	__atomic_add_fetch(&live_message_bytes, message->length, __ATOMIC_RELAXED);
+	if (prefix_length > 0)
+		memcpy(message->data, prefix, prefix_length);
+	if (payload)
+		memcpy(message->data + prefix_length, payload, payload_length);
+	return message;
+}
+
+// Whether any client of that kind is connected. A client counted after this
+// check connected after the broadcast, so it must not get it anyway.
+int peers_connected(int binary)
+{
+	return __atomic_load_n(&peer_counts[binary], __ATOMIC_SEQ_CST) > 0;
+}
+
+// Node links carry the binary rendering, so it is needed while any is up
+int links_connected(void)
+{
+	return __atomic_load_n(&links_up, __ATOMIC_SEQ_CST) > 0;
+}
+
+t_message *message_create_frame(int type, int sender_id, const char *payload, size_t length)
+{
+	t_frame_header header;
+
+	header.length = htonl(length);
+	header.type = htons(type);
+	header.reserved = 0;
+	header.sender = htonl(sender_id);
+	return message_create((const char *)&header, sizeof(header), payload, length);
+}
+
+// Text rendering of a binary payload: every line in it gets the sender's
+// prefix, and a missing final newline is added
+t_message *message_create_text_lines(const char *prefix, size_t prefix_length,
+									 const char *payload, size_t length)
+{
+	const char *end = payload + length;
+	const char *line = payload;
+	const char *newline;
+	size_t line_count = 0;
+	int unterminated = length == 0 || payload[length - 1] != '\n';
+	t_message *message;
+	char *out;
+
+	while ((newline = memchr(line, '\n', end - line)) != NULL)
+	{
+		line_count++;
+		line = newline + 1;
+	}
+	message = message_create(NULL, 0, NULL, length + (line_count + unterminated) * prefix_length + unterminated);
+	out = message->data;
+	for (line = payload; line < end || unterminated; line = newline + 1)
+	{
+		newline = memchr(line, '\n', end - line);
+		size_t line_length = newline ? (size_t)(newline + 1 - line) : (size_t)(end - line);
+
+		memcpy(out, prefix, prefix_length);
+		memcpy(out + prefix_length, line, line_length);
+		out += prefix_length + line_length;
+		if (newline == NULL)
+		{
+			*out = '\n';
+			break;
+		}
+	}
+	return message;
+}
+
+// A message whose bytes are a slice of a history segment's mapping
+t_message *message_create_slice(t_segment *segment, size_t offset, size_t length)
+{
+	int size_class = pool_class(sizeof(t_message));
+	t_message *message = pool_alloc(size_class, sizeof(t_message));
+
+	message->refcount = 1;
+	message->size_class = size_class;
+	message->owner = current_worker - workers;
+	message->room = LOBBY_ROOM;
+	message->remote = 0;
+	message->binary = NULL;
+	message->sequence = 0;
+	message->segment = segment;
+	message->stream = 0;
+	message->stream_end = 0;
+	message->sender = 0;
+	message->bytes = segment->data + offset;
+	message->length = length;
+	message->forward_nodes = NULL;
+	__atomic_add_fetch(&segment->refcount, 1, __ATOMIC_RELAXED);
+	return message;
+}
+
+// Combine the renderings of one broadcast. The text message (an empty one if
+// no text client is connected) carries the binary one and owns its reference.
+t_message *message_pair(t_message *text, t_message *binary)
+{
+	if (text == NULL)
+		text = message_create(NULL, 0, NULL, 0);
+	text->binary = binary;
+	return text;
+}
+
+// A server notice about a client, for the room the client is in
+t_message *message_create_notice(const char *format, int frame_type, int client_id, int room)
+{
+	t_message *text = NULL;
+	t_message *binary = NULL;
+	t_message *message;
+
+	if (peers_connected(0))
+	{
+		char notice[64];
+		int length = snprintf(notice, sizeof(notice), format, client_id);
+
+		text = message_create(notice, length, NULL, 0);
+	}
+	if (peers_connected(1) || links_connected())
+		binary = message_create_frame(frame_type, client_id, NULL, 0);
+	message = message_pair(text, binary);
+	message->room = room;
+	return message;
+}
+
+t_message *message_retain(t_message *message)
+{
+	__atomic_add_fetch(&message->refcount, 1, __ATOMIC_RELAXED);
+	return message;
+}
+
+// Unmap a history segment once neither the log nor any replay uses it
+void segment_release(t_segment *segment)
+{
+	if (__atomic_sub_fetch(&segment->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	munmap(segment->data, segment->data_size);
+	munmap(segment->index, segment->index_size * sizeof(t_history_entry));
+	free(segment);
+}
+
+void message_release(t_message *message)
+{
+	if (__atomic_sub_fetch(&message->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		t_message *binary = message->binary;
+
+		// Replay slices point into the log and never counted as live memory
+		if (message->segment)
+			segment_release(message->segment);
+		else
+			__atomic_sub_fetch(&live_message_bytes, message->length, __ATOMIC_RELAXED);
+		pool_free(message, message->size_class, message->owner);
+		if (binary)
+			message_release(binary);
+	}
+}
+
+// ============================================================================
+// OUTBOUND QUEUES
+// ============================================================================
+
+// Grow an array to hold at least needed entries, zeroing the new tail
+void *grow_array(void *array, size_t *capacity, size_t needed, size_t entry_size)
+{
+	size_t new_capacity = *capacity ? *capacity : 64;
+
+	if (needed <= *capacity)
+		return array;
+	while (new_capacity < needed)
+		new_capacity *= 2;
+	array = realloc(array, entry_size * new_capacity);
+	if (array == NULL)
+		fatal_error(NULL);
+	STAT_ADD(alloc_buffers, 1);
+	bzero((char *)array + entry_size * *capacity, entry_size * (new_capacity - *capacity));
+	*capacity = new_capacity;
+	return array;
+}
+
+void *grow_pointer_array(void *array, size_t *capacity, size_t needed)
+{
+	return grow_array(array, capacity, needed, sizeof(void *));
+}
+
+
+void outbound_push(t_outbound *queue, t_message *message, size_t offset)
+{
+	if (queue->count == queue->capacity)
+	{
+		size_t new_capacity = queue->capacity ? queue->capacity * 2 : 16;
+		t_message **entries = malloc(sizeof(*entries) * new_capacity);
+
+		if (entries == NULL)
+			fatal_error(NULL);
+		// Unwrap the ring into the new array
+		for (size_t i = 0; i < queue->count; i++)
+			entries[i] = queue->entries[(queue->head + i) & (queue->capacity - 1)];
+		free(queue->entries);
+		queue->entries = entries;
+		queue->head = 0;
+		queue->capacity = new_capacity;
+		STAT_ADD(alloc_buffers, 1);
+	}
+	queue->entries[(queue->head + queue->count) & (queue->capacity - 1)] = message_retain(message);
+	if (queue->count == 0)
+		queue->head_offset = offset;
+	queue->count++;
+	queue->bytes += message->length - offset;
+	STAT_ADD(deliveries, 1);
+	STAT_ADD(queued_messages, 1);
+	STAT_MAX(queue_depth_max, queue->count);
+}
+
+// Queue message at position instead of at the tail
+void outbound_insert(t_outbound *queue, size_t position, t_message *message)
+{
+	size_t mask;
+
+	outbound_push(queue, message, 0);
+	mask = queue->capacity - 1;
+	for (size_t i = queue->count - 1; i > position; i--)
+		queue->entries[(queue->head + i) & mask] = queue->entries[(queue->head + i - 1) & mask];
+	queue->entries[(queue->head + position) & mask] = message;
+}
+
+void outbound_pop(t_outbound *queue)
+{
+	message_release(queue->entries[queue->head]);
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	queue->count--;
+	queue->head_offset = 0;
+	STAT_ADD(queued_messages, -1);
+}
+
+// Mark n more bytes as sent, releasing every message fully written
+void outbound_consume(t_outbound *queue, size_t bytes_sent)
+{
+	queue->bytes -= bytes_sent;
+	while (bytes_sent > 0)
+	{
+		size_t head_remaining = queue->entries[queue->head]->length - queue->head_offset;
+
+		if (bytes_sent < head_remaining)
+		{
+			queue->head_offset += bytes_sent;
+			return;
+		}
+		bytes_sent -= head_remaining;
+		outbound_pop(queue);
+	}
+}
+
+// Drop every queued message; keep a small ring around for the next backlog
+void outbound_clear(t_outbound *queue)
+{
+	while (queue->count > 0)
+		outbound_pop(queue);
+	queue->head = queue->bytes = 0;
+	if (queue->capacity <= OUTBOUND_KEEP)
+		return;
+	free(queue->entries);
+	queue->entries = NULL;
+	queue->capacity = 0;
+}
+
+// Drop the oldest message that is neither partly written nor covered by an
+// in-flight io_uring send. Returns 0 when nothing can be dropped.
+int outbound_drop_oldest(t_client *client)
+{
+	t_outbound *queue = &client->outbound;
+	size_t mask = queue->capacity - 1;
+	size_t keep = queue->head_offset > 0;
+	t_message *dropped;
+
+	if (client->send_in_flight)
+		keep = client->uring_send->header.msg_iovlen;
+	if (keep >= queue->count)
+		return 0;
+	dropped = queue->entries[(queue->head + keep) & mask];
+	if (dropped->stream)
+		return 0; // Dropping part of a streamed line would garble what follows
+	// Close the gap by sliding the kept entries one slot towards the tail
+	for (size_t i = keep; i > 0; i--)
+		queue->entries[(queue->head + i) & mask] = queue->entries[(queue->head + i - 1) & mask];
+	queue->head = (queue->head + 1) & mask;
+	queue->count--;
+	queue->bytes -= dropped->length;
+	STAT_ADD(queued_messages, -1);
+	message_release(dropped);
+	return 1;
+}
+
+// Write as much of the queue as the socket accepts without blocking
+void flush_outbound(t_client *client)
+{
+	t_outbound *queue = &client->outbound;
+	struct iovec iov[FLUSH_IOVECS];
+	struct msghdr header;
+	ssize_t bytes_sent;
+
+	if (client->ring)
+	{
+		ring_flush(client);
+		return;
+	}
+	while (queue->count > 0)
+	{
+		// Gather up to FLUSH_IOVECS queued messages into one sendmsg()
+		size_t iov_count = 0, iov_bytes = 0;
+		while (iov_count < queue->count && iov_count < FLUSH_IOVECS)
+		{
+			t_message *message = queue->entries[(queue->head + iov_count) & (queue->capacity - 1)];
+			size_t offset = iov_count == 0 ? queue->head_offset : 0;
+
+			iov[iov_count].iov_base = message->bytes + offset;
+			iov[iov_count].iov_len = message->length - offset;
+			iov_bytes += iov[iov_count].iov_len;
+			iov_count++;
+		}
+
+		bzero(&header, sizeof(header));
+		header.msg_iov = iov;
+		header.msg_iovlen = iov_count;
+		bytes_sent = sendmsg(client->fd, &header, MSG_NOSIGNAL);
+		STAT_ADD(flush_calls, 1);
+		if (bytes_sent < 0 && errno == EINTR)
+			continue;
+		if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break; // Kernel buffer full, wait for write readiness
+		if (bytes_sent < 0)
+		{
+			// Peer is gone: drop its backlog, the read side reports the departure
+			outbound_clear(queue);
+			break;
+		}
+		STAT_ADD(flush_messages, iov_count);
+		STAT_ADD(flush_bytes, bytes_sent);
+		outbound_consume(queue, bytes_sent);
+		if ((size_t)bytes_sent < iov_bytes)
+		{
+			STAT_ADD(short_writes, 1);
+			break; // Short write, the socket buffer is full
+		}
+	}
+
+	// Only watch write readiness while there is something left to send
+	if ((queue->count > 0) != client->write_armed)
+	{
+		client->write_armed = queue->count > 0;
+		event_watch_writable(client->fd, client->write_armed);
+	}
+}
+
+// Start the flush window, unless one is already open
+void arm_flush_window(void)
+{
+	if (config.flush_window_usec > 0 && !flush_timer_armed)
+	{
+		struct itimerspec window = {.it_value = {.tv_sec = config.flush_window_usec / 1000000,
+												 .tv_nsec = config.flush_window_usec % 1000000 * 1000}};
+		timerfd_settime(flush_timer_fd, 0, &window, NULL);
+		flush_timer_armed = 1;
+	}
+}
+
+// Remember that client has output for the next coalesced flush. With a flush
+// window configured, the first scheduled client starts the window timer.
+void schedule_flush(t_client *client)
+{
+	if (client->flush_scheduled)
+		return;
+	client->flush_scheduled = 1;
+	flush_list = grow_pointer_array(flush_list, &flush_capacity, flush_count + 1);
+	flush_list[flush_count++] = client;
+	arm_flush_window();
+}
+
+// ============================================================================
+// SLOW CONSUMERS
+// ============================================================================
+
+// Drop the oldest message held back behind a streamed line, other than
+// chunks of another streamed line. Returns 0 if there is none.
+int stream_held_drop_oldest(t_client *client)
+{
+	for (size_t i = 0; i < client->stream_held_count; i++)
+	{
+		t_message *dropped = client->stream_held[i];
+
+		if (dropped->stream)
+			continue;
+		memmove(client->stream_held + i, client->stream_held + i + 1,
+				(client->stream_held_count - i - 1) * sizeof(*client->stream_held));
+		client->stream_held_count--;
+		client->stream_held_bytes -= dropped->length;
+		message_release(dropped);
+		return 1;
+	}
+	return 0;
+}
+
+// Disconnect client with its backlog dropped now; the departure notice and the
+// cleanup run from the flush, outside whatever loop got here. Returns 0 if it
+// was already on its way out.
+int disconnect_later(t_client *client)
+{
+	if (client->evicted)
+		return 0;
+	client->evicted = 1;
+	while (outbound_drop_oldest(client) || stream_held_drop_oldest(client))
+		;
+	schedule_flush(client);
+	return 1;
+}
+
+// Disconnect a consumer that fell too far behind
+void evict_client(t_client *client)
+{
+	if (disconnect_later(client))
+		STAT_ADD(slow_disconnects, 1);
+}
+
+void pause_reading(void)
+{
+	if (reads_paused)
+		return;
+	reads_paused = 1;
+	STAT_ADD(read_pauses, 1);
+}
+
+// Stop reading from client until resume_reading(). select would keep
+// reporting the fd readable, so it also leaves the read set meanwhile.
+void park_reader(t_client *client)
+{
+	if (client->read_paused)
+		return;
+	client->read_paused = 1;
+	paused_list = grow_pointer_array(paused_list, &paused_capacity, paused_count + 1);
+	paused_list[paused_count++] = client;
+	if (config.backend == BACKEND_SELECT)
+		FD_CLR(client->fd, &master_set);
+}
+
+// Apply the slow-consumer policy before message joins client's backlog: its
+// queue and what a streamed line holds back. Returns 0 if message must not be
+// queued. The cap bounds the backlog a message joins, so a single line longer
+// than the cap still gets through; so do the chunks of a streamed line, which
+// is a single line too.
+int admit_to_queue(t_client *client, t_message *message)
+{
+	t_outbound *queue = &client->outbound;
+	size_t backlog = queue->bytes + client->stream_held_bytes;
+
+	if (backlog == 0 || backlog + message->length <= (size_t)config.client_queue_max || message->stream)
+		return 1;
+	if (config.slow_policy == SLOW_DISCONNECT)
+	{
+		evict_client(client);
+		return 0;
+	}
+	if (config.slow_policy == SLOW_BACKPRESSURE)
+	{
+		pause_reading();
+		return 1;
+	}
+	while (queue->bytes + client->stream_held_bytes + message->length > (size_t)config.client_queue_max &&
+		   (outbound_drop_oldest(client) || stream_held_drop_oldest(client)))
+		STAT_ADD(slow_drops, 1);
+	return 1;
+}
+
+// Over the server-wide budget: act on this worker's longest backlogs until
+// memory is back under budget. Only clients holding a quarter of the per-client
+// cap (or of the budget, if smaller) count as slow, so consumers that keep up
+// are never touched.
+void relieve_queue_budget(void)
+{
+	if (config.slow_policy == SLOW_BACKPRESSURE)
+	{
+		pause_reading();
+		return;
+	}
+	while (__atomic_load_n(&live_message_bytes, __ATOMIC_RELAXED) > config.queue_budget)
+	{
+		t_client *slowest = NULL;
+		size_t slowest_bytes = (config.client_queue_max < config.queue_budget ? config.client_queue_max
+																				 : config.queue_budget) / 4;
+
+		for (size_t i = 0; i < registry.active_count; i++)
+		{
+			t_client *client = registry.active[i];
+
+			if (!client->evicted && client->outbound.bytes + client->stream_held_bytes > slowest_bytes)
+			{
+				slowest = client;
+				slowest_bytes = client->outbound.bytes + client->stream_held_bytes;
+			}
+		}
+		if (slowest == NULL)
+			return;
+		if (config.slow_policy == SLOW_DISCONNECT)
+			evict_client(slowest);
+		else if (!outbound_drop_oldest(slowest) && !stream_held_drop_oldest(slowest))
+			return; // Everything left is being written right now, or is part of a streamed line
+		else
+			STAT_ADD(slow_drops, 1);
+	}
+}
+
+// A streamed line must reach a text client in one piece, so while one is open
+// everything else for the client is held back, in order, until its last
+// chunk. What is held is part of the client's backlog, under the same
+// slow-consumer policy. Chunks of a line that started before the client
+// entered the room are skipped. Returns 0 if message is not to be queued now.
+int stream_admit(t_client *client, t_message *message)
+{
+	if (message->stream && message->stream <= client->room_serial)
+		return 0;
+	if (client->stream_open ? message->stream != client->stream_open : client->stream_held_count > 0)
+	{
+		if (client->evicted || !admit_to_queue(client, message))
+			return 0;
+		client->stream_held = grow_pointer_array(client->stream_held, &client->stream_held_capacity,
+												 client->stream_held_count + 1);
+		client->stream_held[client->stream_held_count++] = message_retain(message);
+		client->stream_held_bytes += message->length;
+		return 0;
+	}
+	if (message->stream)
+		client->stream_open = message->stream_end ? 0 : message->stream;
+	return 1;
+}
+
+// The line streaming to client ended: queue what it held back, up to the
+// next held streamed line that is still open
+void stream_release_held(t_client *client)
+{
+	while (client->stream_held_count > 0 && client->stream_open == 0)
+	{
+		t_message **held = client->stream_held;
+		size_t count = client->stream_held_count;
+
+		client->stream_held = NULL;
+		client->stream_held_count = client->stream_held_capacity = 0;
+		client->stream_held_bytes = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (stream_admit(client, held[i]) && !client->evicted && admit_to_queue(client, held[i]))
+				outbound_push(&client->outbound, held[i], 0);
+			message_release(held[i]);
+		}
+		free(held);
+	}
+	if (!client->write_armed)
+		schedule_flush(client);
+}
+
+// client stops receiving the line streaming to it (it changes rooms, or is
+// handed over): end the line here and let the held messages through
+void stream_cut(t_client *client)
+{
+	t_message *newline = message_create("\n", 1, NULL, 0);
+
+	client->stream_open = 0;
+	if (!client->evicted)
+		outbound_push(&client->outbound, newline, 0);
+	message_release(newline);
+	stream_release_held(client);
+}
+
+// Queue a reference to message for client; the bytes are never copied. Output
+// is coalesced and written with one sendmsg() per client by the next flush.
+void send_to_client(t_client *client, t_message *message)
+{
+	if (message->sequence && message->sequence < client->arrival_sequence)
+		return; // Logged before the client connected: only a replay sends it
+	if (client->binary)
+		message = message->binary;
+	if (message == NULL || message->length == 0)
+		return; // Not rendered for this kind of client
+	if (!client->binary && !stream_admit(client, message))
+		return;
+	if (client->evicted || !admit_to_queue(client, message))
+		return;
+	outbound_push(&client->outbound, message, 0);
+	if (message->stream_end && client->stream_held_count > 0)
+		stream_release_held(client);
+	// A client already waiting for write readiness is flushed by the event loop
+	if (!client->write_armed)
+		schedule_flush(client);
+}
+
+// ============================================================================
+// RATE LIMITING
+// ============================================================================
+
+int rate_limited(t_client *client)
+{
+	return (config.rate_lines > 0 || config.rate_bytes > 0) && client->link == NULL;
+}
+
+// Add the tokens earned since the last refill; each bucket holds one second
+void rate_refill(t_client *client, unsigned long now)
+{
+	double elapsed = (now - client->tokens_usec) / 1e6;
+
+	client->tokens_usec = now;
+	client->line_tokens += elapsed * config.rate_lines;
+	if (client->line_tokens > config.rate_lines)
+		client->line_tokens = config.rate_lines;
+	client->byte_tokens += elapsed * config.rate_bytes;
+	if (client->byte_tokens > config.rate_bytes)
+		client->byte_tokens = config.rate_bytes;
+}
+
+// Bytes client may be read for now, up to limit; 0 if it is over its rate.
+// Lines are only counted once read, so a burst of short lines leaves the line
+// bucket in debt and the client waits until it is paid off.
+size_t rate_read_allowance(t_client *client, size_t limit)
+{
+	if (!rate_limited(client))
+		return limit;
+	rate_refill(client, monotonic_usec());
+	if (config.rate_lines > 0 && client->line_tokens < 1)
+		return 0;
+	if (config.rate_bytes > 0 && client->byte_tokens < 1)
+		return 0;
+	if (config.rate_bytes > 0 && client->byte_tokens < limit)
+		return client->byte_tokens;
+	return limit;
+}
+
+// When both buckets allow a worthwhile read again
+unsigned long rate_ready_usec(t_client *client)
+{
+	double wait = 0;
+	double byte_goal = (double)config.rate_bytes / RATE_WAKEUPS_PER_SEC;
+
+	if (config.rate_lines > 0 && client->line_tokens < 1)
+		wait = (1 - client->line_tokens) / config.rate_lines;
+	if (byte_goal < 1)
+		byte_goal = 1;
+	if (config.rate_bytes > 0 && client->byte_tokens < byte_goal && (byte_goal - client->byte_tokens) / config.rate_bytes > wait)
+		wait = (byte_goal - client->byte_tokens) / config.rate_bytes;
+	return client->tokens_usec + (unsigned long)(wait * 1e6) + 1;
+}
+
+// Stop reading client until its buckets refill: its socket fills up and TCP
+// flow control slows the sender down. The throttle timer releases it.
+void throttle_client(t_client *client)
+{
+	unsigned long ready;
+
+	if (client->throttled)
+		return; // Already in throttled_list, which must hold it once
+	ready = rate_ready_usec(client);
+	client->throttled = 1;
+	throttled_list = grow_pointer_array(throttled_list, &throttled_capacity, throttled_count + 1);
+	throttled_list[throttled_count++] = client;
+	if (config.backend == BACKEND_SELECT)
+		FD_CLR(client->fd, &master_set);
+	if (throttle_timer_usec == 0 || ready < throttle_timer_usec)
+	{
+		struct itimerspec expiry = {.it_value = {.tv_sec = ready / 1000000, .tv_nsec = ready % 1000000 * 1000}};
+
+		timerfd_settime(throttle_timer_fd, TFD_TIMER_ABSTIME, &expiry, NULL);
+		throttle_timer_usec = ready;
+	}
+	STAT_ADD(throttles, 1);
+}
+
+// With a line rate, a text client is read no further than the last line its
+// tokens cover; the lines after it stay in the socket
+size_t line_rate_allowance(t_client *client, size_t allowance)
+{
+	ssize_t peeked = recv(client->fd, receive_buffer, allowance, MSG_PEEK);
+	const char *line = receive_buffer;
+	const char *newline;
+
+	for (double tokens = client->line_tokens; tokens >= 1 && peeked > 0; tokens--)
+	{
+		newline = memchr(line, '\n', receive_buffer + peeked - line);
+		if (newline == NULL)
+			break;
+		line = newline + 1;
+	}
+	if (peeked > 0 && line > receive_buffer)
+		return line - receive_buffer;
+	return allowance;
+}
+
+// Round-robin: a reader that used its turn's budget goes to the back of the
+// line, and is served again once every other ready socket had its turn
+void carry_reader(t_client *client)
+{
+	if (client->read_carried)
+		return;
+	client->read_carried = 1;
+	carried_list = grow_pointer_array(carried_list, &carried_capacity, carried_count + 1);
+	carried_list[carried_count++] = client;
+}
+
+// ============================================================================
+// TIMER WHEEL
+// ============================================================================
+
+// File timer under the slot of the lowest level whose span covers its
+// distance from now
+void timer_file(t_timer *timer, unsigned long expires)
+{
+	unsigned long distance = expires - timer_wheel.now;
+	t_timer **head;
+	int level = 0;
+
+	while (level < WHEEL_LEVELS - 1 && distance >> (WHEEL_BITS * (level + 1)))
+		level++;
+	timer->expires = expires;
+	timer->level = level;
+	timer->slot = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	head = &timer_wheel.slots[level][timer->slot];
+	timer->next = *head;
+	if (*head)
+		(*head)->link = &timer->next;
+	*head = timer;
+	timer->link = head;
+	timer_wheel.occupied[level] |= (uint64_t)1 << timer->slot;
+}
+
+// Deadlines already past fire on the next tick; those beyond the top level's
+// span fire early, and their owner files them again
+void timer_insert(t_timer *timer, unsigned long expires)
+{
+	unsigned long horizon = (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	if (timer_wheel.count++ == 0)
+		timer_wheel.now = monotonic_usec() / WHEEL_TICK_USEC; // Nothing to catch up on
+	if (expires < timer_wheel.now)
+		expires = timer_wheel.now;
+	if (expires - timer_wheel.now > horizon)
+		expires = timer_wheel.now + horizon;
+	timer_file(timer, expires);
+}
+
+void timer_cancel(t_timer *timer)
+{
+	if (timer->link == NULL)
+		return;
+	*timer->link = timer->next;
+	if (timer->next)
+		timer->next->link = timer->link;
+	if (timer_wheel.slots[timer->level][timer->slot] == NULL)
+		timer_wheel.occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+	timer->link = NULL;
+	timer_wheel.count--;
+}
+
+// The next tick with work: a level 0 slot to expire, or the start of a
+// higher level slot whose timers move down. ULONG_MAX for an empty wheel.
+unsigned long timer_next_tick(void)
+{
+	unsigned long next = ULONG_MAX;
+
+	for (int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		int shift = WHEEL_BITS * level;
+		unsigned long position = timer_wheel.now >> shift;
+		int index = position & (WHEEL_SLOTS - 1);
+		uint64_t ahead = timer_wheel.occupied[level];
+		unsigned long distance;
+
+		if (ahead == 0)
+			continue;
+		// Bit 0 becomes the current slot. Above level 0, once its first tick
+		// has run that slot was moved down, so what it holds is due next round.
+		if (index > 0)
+			ahead = ahead >> index | ahead << (WHEEL_SLOTS - index);
+		if (level > 0 && (timer_wheel.now & ((1UL << shift) - 1)) != 0)
+			ahead &= ~(uint64_t)1;
+		distance = ahead ? (unsigned long)__builtin_ctzll(ahead) : WHEEL_SLOTS;
+		if ((position + distance) << shift < next)
+			next = (position + distance) << shift;
+	}
+	return next;
+}
+
+// Refile the timers of the level slot starting at the current tick
+void timer_cascade(int level)
+{
+	int slot = (timer_wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	t_timer *timer = timer_wheel.slots[level][slot];
+
+	timer_wheel.slots[level][slot] = NULL;
+	timer_wheel.occupied[level] &= ~((uint64_t)1 << slot);
+	while (timer)
+	{
+		t_timer *next = timer->next;
+
+		timer_file(timer, timer->expires);
+		timer = next;
+	}
+}
+
+// Run the wheel up to tick target, jumping straight between ticks that have
+// work, and return the timers that expired, linked through next
+t_timer *timer_advance(unsigned long target)
+{
+	t_timer *expired = NULL;
+	unsigned long tick;
+
+	while ((tick = timer_next_tick()) <= target)
+	{
+		int level = 1;
+		int slot = tick & (WHEEL_SLOTS - 1);
+
+		timer_wheel.now = tick;
+		while (level < WHEEL_LEVELS && (tick & ((1UL << (WHEEL_BITS * level)) - 1)) == 0)
+			level++;
+		while (--level > 0)
+			timer_cascade(level);
+
+		for (t_timer *timer = timer_wheel.slots[0][slot], *next; timer; timer = next)
+		{
+			next = timer->next;
+			timer->link = NULL;
+			timer->next = expired;
+			expired = timer;
+			timer_wheel.count--;
+		}
+		timer_wheel.slots[0][slot] = NULL;
+		timer_wheel.occupied[0] &= ~((uint64_t)1 << slot);
+		timer_wheel.now = tick + 1;
+	}
+	if (timer_wheel.now <= target)
+		timer_wheel.now = target + 1;
+	return expired;
+}
+
+// Set the idle timer for the next tick with work, unless it goes off sooner
+// anyway: an early expiry just advances the wheel and sets it again
+void idle_timer_schedule(void)
+{
+	unsigned long tick = timer_next_tick();
+
+	if (tick == ULONG_MAX || (idle_timer_tick != 0 && idle_timer_tick <= tick))
+		return;
+
+	unsigned long usec = tick * WHEEL_TICK_USEC;
+	struct itimerspec expiry = {.it_value = {.tv_sec = usec / 1000000, .tv_nsec = usec % 1000000 * 1000}};
+
+	timerfd_settime(idle_timer_fd, TFD_TIMER_ABSTIME, &expiry, NULL);
+	idle_timer_tick = tick;
+}
+
+// Reads only record when they happened; the deadline is checked against that
+// when its timer fires, so a busy client costs no wheel operations per read
+void idle_watch(t_client *client)
+{
+	unsigned long deadline = client->active_usec + config.idle_usec;
+
+	timer_insert(&client->idle_timer, (deadline + WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC);
+	idle_timer_schedule();
+}
+
+// Like idle_watch(), for the streamed line client is sending: chunks only
+// record when they arrived
+void stream_watch(t_client *client)
+{
+	unsigned long deadline = client->stream_usec + config.stream_stall_usec;
+
+	timer_insert(&client->stream_timer, (deadline + WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC);
+	idle_timer_schedule();
+}
+
+// A streamed line that stopped holds back everything else for its
+// recipients, so it is ended as if the sender had left; what the sender
+// sends next is a new line
+void stream_timer_expired(t_client *client, unsigned long now)
+{
+	if (!client->stream_out)
+		return;
+	if (client->stream_usec + config.stream_stall_usec > now)
+		stream_watch(client);
+	else
+	{
+		stream_chunk(client, "\n", 1, 1);
+		STAT_ADD(stream_stalls, 1);
+	}
+}
+
+// Disconnect the clients that sent nothing since their deadline was set, with
+// the usual departure notice, and give the others a new one. Stalled streamed
+// lines are ended.
+void idle_timer_expired(void)
+{
+	unsigned long now = monotonic_usec();
+	uint64_t expirations;
+	t_timer *timer;
+
+	read(idle_timer_fd, &expirations, sizeof(expirations));
+	idle_timer_tick = 0;
+	if (handing_over)
+		return; // The new process starts their clocks again
+	timer = timer_advance(now / WHEEL_TICK_USEC);
+	while (timer)
+	{
+		t_client *client = (t_client *)((char *)timer - offsetof(t_client, idle_timer));
+
+		if (timer->kind == TIMER_STREAM)
+		{
+			client = (t_client *)((char *)timer - offsetof(t_client, stream_timer));
+			timer = timer->next;
+			stream_timer_expired(client, now);
+			continue;
+		}
+		timer = timer->next;
+		// Left unread by backpressure, fairness or its rate limit, not idle
+		if (client->read_paused || client->read_carried || client->throttled)
+			client->active_usec = now;
+		if (client->active_usec + config.idle_usec > now)
+			idle_watch(client);
+		else if (disconnect_later(client))
+			STAT_ADD(idle_reaps, 1);
+	}
+	idle_timer_schedule();
+}
+
+// ============================================================================
+// INBOUND BUFFERS
+// ============================================================================
+
+void inbound_append(t_inbound *inbound, const char *data, size_t length)
+{
+	if (inbound->length + length > inbound->capacity)
+	{
+		size_t new_capacity = inbound->capacity ? inbound->capacity : 256;
+		while (new_capacity < inbound->length + length)
+			new_capacity *= 2; // Doubling keeps huge lines linear overall
+		inbound->data = realloc(inbound->data, new_capacity);
+		if (inbound->data == NULL)
+			fatal_error(NULL);
+		inbound->capacity = new_capacity;
+		STAT_ADD(alloc_buffers, 1);
+	}
+	memcpy(inbound->data + inbound->length, data, length);
+	inbound->length += length;
+}
+
+// Forget the pending bytes; keep a small buffer around for the next partial line
+void inbound_clear(t_inbound *inbound, int keep_small_buffer)
+{
+	inbound->length = 0;
+	if (keep_small_buffer && inbound->capacity <= INBOUND_KEEP)
+		return;
+	free(inbound->data);
+	inbound->data = NULL;
+	inbound->capacity = 0;
+}
+
+// ============================================================================
+// WORKER INBOXES
+// ============================================================================
+
+void inbox_init(t_inbox *inbox)
+{
+	inbox->stub.next = NULL;
+	inbox->head = inbox->tail = &inbox->stub;
+}
+
+// Safe to call from any thread
+void inbox_push(t_inbox *inbox, t_inbox_node *node)
+{
+	t_inbox_node *previous;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	previous = __atomic_exchange_n(&inbox->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+// Owner thread only. Returns NULL when empty or while a push is still linking.
+t_inbox_node *inbox_pop(t_inbox *inbox)
+{
+	t_inbox_node *tail = inbox->tail;
+	t_inbox_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &inbox->stub)
+	{
+		if (next == NULL)
+			return NULL;
+		inbox->tail = tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next)
+	{
+		inbox->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&inbox->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	// tail is the last node: park the stub behind it so it can be handed out
+	inbox_push(inbox, &inbox->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next == NULL)
+		return NULL;
+	inbox->tail = next;
+	return tail;
+}
+
+// Hand a reference to message to every other worker; per-sender order is kept
+// because each inbox is FIFO per producer
+void forward_to_other_workers(t_message *message)
+{
+	uint64_t one = 1;
+
+	for (int i = 0; i < config.worker_count; i++)
+	{
+		t_worker *worker = &workers[i];
+		t_inbox_node *node = &message->forward_nodes[i];
+
+		if (worker == current_worker)
+			continue;
+		node->message = message_retain(message);
+		inbox_push(&worker->inbox, node);
+		// One eventfd write per burst: skip it while a wakeup is still pending
+		if (!__atomic_exchange_n(&worker->wake_posted, 1, __ATOMIC_ACQ_REL))
+			write(worker->wake_fd, &one, sizeof(one));
+	}
+}
+
+// ============================================================================
+// NODE LINK BATCHING
+// ============================================================================
+
+// Queue what link collected since the last flush as one FRAME_BATCH. Like a
+// client's backlog, the link's is held to the slow-consumer policy.
+void link_seal_batch(t_link *link)
+{
+	t_message *message = message_create_frame(FRAME_BATCH, config.node_id, link->batch.data, link->batch.length);
+
+	link->batch.length = 0; // The buffer is kept for the next batch
+	if (!link->client->evicted && admit_to_queue(link->client, message))
+		outbound_push(&link->client->outbound, message, 0);
+	message_release(message);
+	STAT_ADD(link_batches, 1);
+}
+
+// A batch entry is a binary frame with the room name inserted after the
+// header, whose reserved field gives the name's length (0 for the lobby)
+void link_append_entry(t_link *link, t_frame_header header, const char *room_name, size_t room_length,
+					   const char *payload)
+{
+	size_t payload_length = ntohl(header.length);
+
+	if (link->batch.length > 0 &&
+		link->batch.length + sizeof(header) + room_length + payload_length > LINK_BATCH_MAX)
+		link_seal_batch(link);
+	header.reserved = htons(room_length);
+	inbound_append(&link->batch, (const char *)&header, sizeof(header));
+	inbound_append(&link->batch, room_name, room_length);
+	inbound_append(&link->batch, payload, payload_length);
+}
+
+// A broadcast goes as its binary frame; a batched presence notice holds
+// several frames, one entry each
+void link_append_entries(t_link *link, t_message *binary, const char *room_name, size_t room_length)
+{
+	t_frame_header header;
+
+	for (size_t offset = 0; offset < binary->length; offset += sizeof(header) + ntohl(header.length))
+	{
+		memcpy(&header, binary->bytes + offset, sizeof(header));
+		link_append_entry(link, header, room_name, room_length, binary->bytes + offset + sizeof(header));
+	}
+	schedule_flush(link->client);
+}
+
+// A chunk of a streamed line goes as a FRAME_STREAM entry, or FRAME_STREAM_END
+// for the last one, so the other node can stream the line on in one piece
+void link_append_stream(t_link *link, t_message *message, const char *room_name, size_t room_length)
+{
+	t_frame_header header;
+	size_t length = message->binary ? message->binary->length - sizeof(header) : 0;
+
+	header.length = htonl(length);
+	header.type = htons(message->stream_end ? FRAME_STREAM_END : FRAME_STREAM);
+	header.sender = htonl(message->sender);
+	link_append_entry(link, header, room_name, room_length,
+					  message->binary ? message->binary->bytes + sizeof(header) : "");
+	schedule_flush(link->client);
+}
+
+// Worker 0 sees every local broadcast, its own or through its inbox, and
+// appends it to every link that is up. Links form a full mesh and nothing is
+// relayed, so each node gets a broadcast exactly once, in the sender's order.
+void forward_to_links(t_message *message)
+{
+	char room_name[ROOM_NAME_MAX];
+	size_t room_length = 0;
+
+	if (message->binary == NULL && !message->stream_end)
+		return; // Rendered before the first link came up
+	if (message->room != LOBBY_ROOM)
+	{
+		pthread_mutex_lock(&room_lock);
+		room_length = strlen(room_names[message->room]);
+		memcpy(room_name, room_names[message->room], room_length);
+		pthread_mutex_unlock(&room_lock);
+	}
+	for (size_t i = 0; i < link_count; i++)
+	{
+		if (links[i]->node < 0 || links[i]->client->evicted)
+			continue;
+		if (message->stream)
+			link_append_stream(links[i], message, room_name, room_length);
+		else
+			link_append_entries(links[i], message->binary, room_name, room_length);
+	}
+}
+
+// ============================================================================
+// MESSAGE BROADCASTING
+// ============================================================================
+
+// Queue message for the members of its room that this worker owns
+void broadcast_to_local_clients(t_client *sender, t_message *message)
+{
+	if ((size_t)message->room < room_capacity)
+	{
+		t_room *room = &rooms[message->room];
+
+		for (size_t i = 0; i < room->count; i++)
+		{
+			if (room->members[i] != sender)
+			{
+				send_to_client(room->members[i], message);
+			}
+		}
+	}
+	if (link_count > 0 && current_worker == &workers[0] && !message->remote)
+		forward_to_links(message);
+	if (__atomic_load_n(&live_message_bytes, __ATOMIC_RELAXED) > config.queue_budget)
+		relieve_queue_budget();
+}
+
+void broadcast_to_all_except(t_client *sender, t_message *message)
+{
+	broadcast_to_local_clients(sender, message);
+	if (config.worker_count > 1)
+		forward_to_other_workers(message);
+}
+
+// Deliver what other workers broadcast to the clients this worker owns
+void drain_worker_inbox(void)
+{
+	uint64_t counter;
+	t_inbox_node *node;
+
+	read(current_worker->wake_fd, &counter, sizeof(counter));
+	// Clear the flag before popping so a concurrent push either is seen by
+	// this drain or posts a fresh wakeup
+	__atomic_store_n(&current_worker->wake_posted, 0, __ATOMIC_SEQ_CST);
+	while ((node = inbox_pop(&current_worker->inbox)) != NULL)
+	{
+		// The sender lives on another worker, so nobody here is excluded
+		broadcast_to_local_clients(NULL, node->message);
+		message_release(node->message); // The node lives in the message itself
+	}
+}
+
+// ============================================================================
+// CLIENT REGISTRY
+// ============================================================================
+
+size_t id_slot(int client_id)
+{
+	return ((unsigned int)client_id * 2654435761u) & (registry.id_capacity - 1);
+}
+
+void id_table_insert(t_client *client)
+{
+	size_t slot = id_slot(client->client_id);
+
+	while (registry.by_id[slot])
+		slot = (slot + 1) & (registry.id_capacity - 1);
+	registry.by_id[slot] = client;
+}
+
+// Keep the id table at most half full so probe sequences stay short
+void id_table_reserve(size_t client_count)
+{
+	t_client **old_table = registry.by_id;
+	size_t old_capacity = registry.id_capacity;
+
+	if (client_count * 2 <= registry.id_capacity)
+		return;
+	registry.id_capacity = old_capacity ? old_capacity * 2 : 128;
+	registry.by_id = calloc(registry.id_capacity, sizeof(*registry.by_id));
+	if (registry.by_id == NULL)
+		fatal_error(NULL);
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old_table[i])
+			id_table_insert(old_table[i]);
+	}
+	free(old_table);
+}
+
+// Linear-probing delete: shift later entries back instead of leaving tombstones
+void id_table_remove(t_client *client)
+{
+	size_t mask = registry.id_capacity - 1;
+	size_t hole = id_slot(client->client_id);
+	size_t next;
+
+	while (registry.by_id[hole] != client)
+		hole = (hole + 1) & mask;
+	registry.by_id[hole] = NULL;
+
+	for (next = (hole + 1) & mask; registry.by_id[next]; next = (next + 1) & mask)
+	{
+		size_t home = id_slot(registry.by_id[next]->client_id);
+
+		// Entries whose home slot lies cyclically in (hole, next] stay put
+		if ((next > hole && (home <= hole || home > next)) ||
+			(next < hole && home <= hole && home > next))
+		{
+			registry.by_id[hole] = registry.by_id[next];
+			registry.by_id[next] = NULL;
+			hole = next;
+		}
+	}
+}
+
+t_client *client_find_by_fd(int fd)
+{
+	if (fd < 0 || (size_t)fd >= registry.fd_capacity)
+		return NULL;
+	return registry.by_fd[fd];
+}
+
+t_client *client_find_by_id(int client_id)
+{
+	size_t slot;
+
+	if (registry.id_capacity == 0)
+		return NULL;
+	for (slot = id_slot(client_id); registry.by_id[slot]; slot = (slot + 1) & (registry.id_capacity - 1))
+	{
+		if (registry.by_id[slot]->client_id == client_id)
+			return registry.by_id[slot];
+	}
+	return NULL;
+}
+
+// Take a record from the slab free list, allocating a new slab if empty. The
+// record comes back zeroed except for the buffers it kept from its last use.
+t_client *client_record_alloc(void)
+{
+	t_client *client;
+
+	if (registry.free_records == NULL)
+	{
+		t_client *slab = calloc(CLIENT_SLAB_SIZE, sizeof(*slab));
+
+		if (slab == NULL)
+			fatal_error(NULL);
+		STAT_ADD(alloc_slabs, 1);
+		for (int i = CLIENT_SLAB_SIZE - 1; i >= 0; i--)
+		{
+			slab[i].next_free = registry.free_records;
+			registry.free_records = &slab[i];
+		}
+	}
+	client = registry.free_records;
+	registry.free_records = client->next_free;
+
+	// Small buffers the previous connection left on the record are reused
+	t_inbound inbound = client->inbound;
+	t_outbound outbound = client->outbound;
+	struct s_uring_send *uring_send = client->uring_send;
+
+	bzero(client, sizeof(*client));
+	client->inbound = inbound;
+	client->outbound = outbound;
+	client->uring_send = uring_send;
+	return client;
+}
+
+void registry_add(t_client *client)
+{
+	registry.by_fd = grow_pointer_array(registry.by_fd, &registry.fd_capacity, client->fd + 1);
+	registry.by_fd[client->fd] = client;
+
+	registry.active = grow_pointer_array(registry.active, &registry.active_capacity,
+										 registry.active_count + 1);
+	client->active_index = registry.active_count;
+	registry.active[registry.active_count++] = client;
+
+	id_table_reserve(registry.active_count);
+	id_table_insert(client);
+}
+
+// Return a disconnected record to the free list once nothing references it:
+// no io_uring request in flight and no pending entry in flush_list, paused_list,
+// carried_list or throttled_list
+void client_record_release(t_client *client)
+{
+	if (!client->closing || client->uring_inflight > 0 || client->flush_scheduled || client->read_paused ||
+		client->read_carried || client->throttled)
+		return;
+	client->next_free = registry.free_records;
+	registry.free_records = client;
+}
+
+// Swap-remove from the dense array; the caller frees the record
+void registry_remove(t_client *client)
+{
+	t_client *last = registry.active[--registry.active_count];
+
+	registry.active[client->active_index] = last;
+	last->active_index = client->active_index;
+	registry.by_fd[client->fd] = NULL;
+	id_table_remove(client);
+}
+
+// ============================================================================
+// PRESENCE NOTICES
+// ============================================================================
+
+void presence_queue(int type, int client_id, int room, int remote)
+{
+	t_presence *event;
+
+	presence_events = grow_array(presence_events, &presence_capacity, presence_count + 1, sizeof(t_presence));
+	event = &presence_events[presence_count];
+	event->type = type;
+	event->client_id = client_id;
+	event->room = room;
+	event->remote = remote;
+	event->order = presence_count++;
+	if (remote)
+		presence_remote_count++;
+	arm_flush_window(); // Held events are announced by the next flush
+}
+
+int presence_compare(const void *left, const void *right)
+{
+	const t_presence *a = left;
+	const t_presence *b = right;
+
+	if (a->room != b->room)
+		return a->room < b->room ? -1 : 1;
+	return (a->order > b->order) - (a->order < b->order);
+}
+
+// One notice for a run of events of one kind in one room: the usual line for
+// a single client, a list of ids for several, and for binary clients the
+// frames back to back
+t_message *presence_notice(const t_presence *run, size_t count)
+{
+	const char *action = run->type == FRAME_ARRIVED ? "arrived" : "left";
+	t_message *text = NULL;
+	t_message *binary = NULL;
+	t_message *message;
+
+	if (peers_connected(0))
+	{
+		char *line = malloc(32 + count * PRESENCE_ID_WIDTH);
+		int length;
+
+		if (line == NULL)
+			fatal_error(NULL);
+		length = sprintf(line, "server: client%s", count > 1 ? "s" : "");
+		for (size_t i = 0; i < count; i++)
+			length += sprintf(line + length, "%s %d", i > 0 ? "," : "", run[i].client_id);
+		length += sprintf(line + length, " just %s\n", action);
+		text = message_create(line, length, NULL, 0);
+		free(line);
+	}
+	if (peers_connected(1) || links_connected())
+	{
+		t_frame_header header = {.type = htons(run->type)};
+
+		binary = message_create(NULL, 0, NULL, count * sizeof(header));
+		for (size_t i = 0; i < count; i++)
+		{
+			header.sender = htonl(run[i].client_id);
+			memcpy(binary->data + i * sizeof(header), &header, sizeof(header));
+		}
+	}
+	message = message_pair(text, binary);
+	message->room = run->room;
+	message->remote = run->remote;
+	return message;
+}
+
+// Announce the held events. Sorting by room keeps each room's events in
+// order, and consecutive ones of the same kind share a notice. A client
+// arriving alone is spared its own notice as before; one arriving with
+// others finds itself in the list.
+void presence_flush(void)
+{
+	t_presence *events = presence_events;
+	size_t count = presence_count;
+	size_t start = 0;
+
+	presence_events = NULL;
+	presence_count = presence_capacity = presence_remote_count = 0;
+	presence_batch++;
+	qsort(events, count, sizeof(*events), presence_compare);
+	for (size_t i = 1; i <= count; i++)
+	{
+		t_presence *first = &events[start];
+		t_client *sender = NULL;
+		t_message *message;
+
+		if (i < count && events[i].room == first->room && events[i].type == first->type &&
+			events[i].remote == first->remote)
+			continue;
+		if (i - start == 1 && first->type == FRAME_ARRIVED && !first->remote)
+			sender = client_find_by_id(first->client_id);
+		message = presence_notice(first, i - start);
+		broadcast_to_all_except(sender, message);
+		message_release(message);
+		STAT_ADD(presence_notices, 1);
+		start = i;
+	}
+	free(events);
+}
+
+void notify_client_arrival(t_client *new_client)
+{
+	if (config.presence_batch)
+	{
+		new_client->arrival_batch = presence_batch;
+		presence_queue(FRAME_ARRIVED, new_client->client_id, new_client->room, 0);
+		return;
+	}
+
+	t_message *message = message_create_notice("server: client %d just arrived\n", FRAME_ARRIVED,
+											   new_client->client_id, new_client->room);
+
+	broadcast_to_all_except(new_client, message);
+	message_release(message);
+}
+
+void notify_client_departure(t_client *departed_client)
+{
+	if (departed_client->link)
+		return; // A node link going down is nobody's departure
+	if (config.presence_batch)
+	{
+		presence_queue(FRAME_LEFT, departed_client->client_id, departed_client->room, 0);
+		return;
+	}
+
+	t_message *message = message_create_notice("server: client %d just left\n", FRAME_LEFT,
+											   departed_client->client_id, departed_client->room);
+
+	broadcast_to_all_except(departed_client, message);
+	message_release(message);
+}
+
+// ============================================================================
+// ROOMS
+// ============================================================================
+
+size_t room_slot(const char *name, size_t length)
+{
+	uint32_t hash = 2166136261u; // FNV-1a
+
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	return hash & (room_slot_capacity - 1);
+}
+
+// Keep the name table at most half full, rehashing every room into a larger one
+void room_slots_reserve(void)
+{
+	int *old_slots = room_slots;
+	size_t old_capacity = room_slot_capacity;
+
+	if (room_count * 2 <= room_slot_capacity)
+		return;
+	room_slot_capacity = old_capacity ? old_capacity * 2 : 64;
+	room_slots = calloc(room_slot_capacity, sizeof(*room_slots));
+	if (room_slots == NULL)
+		fatal_error(NULL);
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old_slots[i] == 0)
+			continue;
+		const char *name = room_names[old_slots[i] - 1];
+		size_t slot = room_slot(name, strlen(name));
+
+		while (room_slots[slot])
+			slot = (slot + 1) & (room_slot_capacity - 1);
+		room_slots[slot] = old_slots[i];
+	}
+	free(old_slots);
+}
+
+// Id of the room called name, registering it on first use. Joins are rare
+// next to broadcasts, so a single lock shared by all workers is enough.
+int room_intern(const char *name, size_t length)
+{
+	size_t slot;
+	int room_id;
+
+	if (length == 5 && memcmp(name, "lobby", 5) == 0)
+		return LOBBY_ROOM;
+	pthread_mutex_lock(&room_lock);
+	room_slots_reserve();
+	for (slot = room_slot(name, length); room_slots[slot]; slot = (slot + 1) & (room_slot_capacity - 1))
+	{
+		room_id = room_slots[slot] - 1;
+		if (strncmp(room_names[room_id], name, length) == 0 && room_names[room_id][length] == '\0')
+		{
+			pthread_mutex_unlock(&room_lock);
+			return room_id;
+		}
+	}
+	room_id = room_count++;
+	room_names = grow_array(room_names, &room_names_capacity, room_count, ROOM_NAME_MAX);
+	memcpy(room_names[room_id], name, length); // grow_array zeroed the rest
+	room_slots[slot] = room_id + 1;
+	pthread_mutex_unlock(&room_lock);
+	return room_id;
+}
+
+void room_add(t_client *client, int room_id)
+{
+	t_room *room;
+
+	rooms = grow_array(rooms, &room_capacity, room_id + 1, sizeof(*rooms));
+	room = &rooms[room_id];
+	room->members = grow_pointer_array(room->members, &room->capacity, room->count + 1);
+	client->room = room_id;
+	client->room_index = room->count;
+	room->members[room->count++] = client;
+	if (config.stream_threshold > 0)
+		client->room_serial = __atomic_add_fetch(&stream_clock, 1, __ATOMIC_RELAXED);
+}
+
+// Swap-remove from the member list; an emptied room gives its list back
+void room_remove(t_client *client)
+{
+	t_room *room = &rooms[client->room];
+	t_client *last = room->members[--room->count];
+
+	room->members[client->room_index] = last;
+	last->room_index = client->room_index;
+	if (room->count == 0)
+	{
+		free(room->members);
+		room->members = NULL;
+		room->capacity = 0;
+	}
+}
+
+// Move client to another room: the old room sees it leave, the new one
+// sees it arrive, with the usual notices
+void room_join(t_client *client, int room_id)
+{
+	if (room_id == client->room)
+		return;
+	// Lines other workers sent to the new room before the join must not reach it
+	if (config.worker_count > 1)
+		drain_worker_inbox();
+	if (client->stream_open)
+		stream_cut(client);
+	notify_client_departure(client);
+	room_remove(client);
+	room_add(client, room_id);
+	notify_client_arrival(client);
+	STAT_ADD(room_joins, 1);
+}
+
+// ============================================================================
+// HISTORY LOG
+// ============================================================================
+
+void history_path(char *path, unsigned long first_sequence, const char *extension)
+{
+	if (snprintf(path, PATH_MAX, "%s/%020lu.%s", config.history_dir, first_sequence, extension) >= PATH_MAX)
+		fatal_error("MINI_SERV_HISTORY_DIR too long\n");
+}
+
+// Map one file of a segment. A fresh file is created with size bytes, an
+// existing one is mapped whole and its size returned in size.
+void *history_map(unsigned long first_sequence, const char *extension, size_t *size, int fresh)
+{
+	char path[PATH_MAX];
+	struct stat file_status;
+	void *mapping;
+	int fd;
+
+	history_path(path, first_sequence, extension);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (fresh ? O_TRUNC : 0), 0644);
+	if (fd < 0 || fstat(fd, &file_status) < 0)
+		fatal_error(NULL);
+	if (file_status.st_size > 0)
+		*size = file_status.st_size;
+	else if (ftruncate(fd, *size) < 0)
+		fatal_error(NULL);
+	mapping = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // The mapping keeps the file
+	if (mapping == MAP_FAILED)
+		fatal_error(NULL);
+	return mapping;
+}
+
+// Open the segment whose first line has first_sequence, either new or left
+// by an earlier run; the index tells how much of it was written
+t_segment *segment_open(unsigned long first_sequence, int fresh)
+{
+	t_segment *segment = calloc(1, sizeof(*segment));
+	size_t index_bytes = config.history_segment_size / 4;
+
+	if (segment == NULL)
+		fatal_error(NULL);
+	segment->first_sequence = first_sequence;
+	segment->data_size = config.history_segment_size;
+	segment->data = history_map(first_sequence, "log", &segment->data_size, fresh);
+	segment->index = history_map(first_sequence, "idx", &index_bytes, fresh);
+	segment->index_size = index_bytes / sizeof(t_history_entry);
+	while (segment->count < segment->index_size && segment->index[segment->count].length > 0)
+	{
+		t_history_entry *entry = &segment->index[segment->count];
+
+		if (entry->offset + entry->length > segment->data_size)
+			break; // Torn by a crash, keep what is consistent
+		segment->used = entry->offset + entry->length;
+		segment->count++;
+	}
+	segment->refcount = 1;
+	return segment;
+}
+
+// Append segment to the log, deleting the oldest ones beyond the limit.
+// Replays still reading a deleted segment keep its mapping until they finish.
+void history_add_segment(t_segment *segment)
+{
+	char path[PATH_MAX];
+
+	segment->previous = history_newest;
+	if (history_newest)
+		history_newest->next = segment;
+	else
+		history_oldest = segment;
+	history_newest = segment;
+	history_segment_count++;
+	while (history_segment_count > (size_t)config.history_segments)
+	{
+		t_segment *oldest = history_oldest;
+
+		history_oldest = oldest->next;
+		history_oldest->previous = NULL;
+		history_segment_count--;
+		history_path(path, oldest->first_sequence, "log");
+		unlink(path);
+		history_path(path, oldest->first_sequence, "idx");
+		unlink(path);
+		segment_release(oldest);
+	}
+}
+
+int compare_sequences(const void *a, const void *b)
+{
+	unsigned long first = *(const unsigned long *)a;
+	unsigned long second = *(const unsigned long *)b;
+
+	return (first > second) - (first < second);
+}
+
+// Reopen the segments an earlier run left in the directory, oldest first,
+// and continue numbering after the last line they hold
+void history_open(void)
+{
+	DIR *directory = opendir(config.history_dir);
+	struct dirent *entry;
+	unsigned long *sequences = NULL;
+	size_t count = 0;
+
+	if (directory == NULL)
+		fatal_error("Cannot open MINI_SERV_HISTORY_DIR\n");
+	while ((entry = readdir(directory)) != NULL)
+	{
+		char *end;
+		unsigned long first_sequence = strtoul(entry->d_name, &end, 10);
+
+		if (end != entry->d_name + 20 || strcmp(end, ".log") != 0)
+			continue;
+		sequences = realloc(sequences, sizeof(*sequences) * (count + 1));
+		if (sequences == NULL)
+			fatal_error(NULL);
+		sequences[count++] = first_sequence;
+	}
+	closedir(directory);
+	qsort(sequences, count, sizeof(*sequences), compare_sequences);
+	for (size_t i = 0; i < count; i++)
+		history_add_segment(segment_open(sequences[i], 0));
+	free(sequences);
+	if (history_newest)
+		history_next_sequence = history_newest->first_sequence + history_newest->count;
+}
+
+// Append the text of a broadcast line to the log and return its sequence
+// number, 0 if it does not fit in a segment. Only a memcpy into the mapping
+// happens under the lock, except when a full segment is replaced.
+unsigned long history_append(t_message *message, int room)
+{
+	t_segment *segment;
+	t_history_entry *entry;
+	unsigned long sequence;
+
+	if (message->length > (size_t)config.history_segment_size)
+		return 0;
+	pthread_mutex_lock(&history_lock);
+	segment = history_newest;
+	if (segment == NULL || segment->count == segment->index_size ||
+		segment->used + message->length > segment->data_size)
+	{
+		segment = segment_open(history_next_sequence, 1);
+		history_add_segment(segment);
+	}
+	memcpy(segment->data + segment->used, message->data, message->length);
+	entry = &segment->index[segment->count++];
+	entry->offset = segment->used;
+	entry->room = room;
+	entry->length = message->length; // Written last: a non-zero length marks the entry valid
+	segment->used += message->length;
+	sequence = history_next_sequence;
+	__atomic_store_n(&history_next_sequence, sequence + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&history_lock);
+	STAT_ADD(history_appends, 1);
+	return sequence;
+}
+
+// Queue lines of the client's room that were logged before it connected,
+// ahead of its pending output: the last count of them, or all of them from
+// sequence first on. The lines go out as slices of the mapped segments, in
+// as few pieces as their layout allows, followed by a notice naming the last
+// sequence the replay covers. At most half the per-client queue cap is
+// replayed, the newest lines being kept.
+void history_replay(t_client *client, unsigned long first, unsigned long count)
+{
+	t_outbound *queue = &client->outbound;
+	size_t position = queue->head_offset > 0; // Entries already being written stay first
+	size_t budget = config.client_queue_max / 2;
+	unsigned long last = client->arrival_sequence; // Exclusive
+	unsigned long sequence = last;
+	t_replay_span *spans;
+	size_t span_count = 0, k;
+	t_message *slice = NULL;
+
+	if (client->evicted)
+		return;
+	if (client->send_in_flight)
+		position = client->uring_send->header.msg_iovlen;
+
+	// Only take a reference to every segment with lines from before the
+	// client arrived. Those lines never change, and the references keep the
+	// segments mapped, so the walk needs no lock.
+	pthread_mutex_lock(&history_lock);
+	spans = malloc(sizeof(*spans) * (history_segment_count + 1));
+	if (spans == NULL)
+		fatal_error(NULL);
+	for (t_segment *segment = history_oldest; segment && segment->first_sequence < last; segment = segment->next)
+	{
+		__atomic_add_fetch(&segment->refcount, 1, __ATOMIC_RELAXED);
+		spans[span_count].segment = segment;
+		spans[span_count].end = segment->first_sequence + segment->count;
+		if (spans[span_count].end > last)
+			spans[span_count].end = last;
+		span_count++;
+	}
+	pthread_mutex_unlock(&history_lock);
+
+	// Walk back from the arrival point to where the replay starts
+	k = span_count;
+	while (count > 0 && sequence > first && k > 0)
+	{
+		t_segment *segment = spans[k - 1].segment;
+		t_history_entry *entry;
+
+		if (sequence > spans[k - 1].end)
+		{
+			sequence = spans[k - 1].end; // Lines torn off by a crash
+			continue;
+		}
+		if (sequence <= segment->first_sequence)
+		{
+			k--;
+			continue;
+		}
+		entry = &segment->index[sequence - 1 - segment->first_sequence];
+		if (entry->room == client->room)
+		{
+			if (entry->length > budget)
+				break;
+			budget -= entry->length;
+			count--;
+		}
+		sequence--;
+	}
+
+	// Then queue the room's lines from there on, merging adjacent ones
+	for (k = 0; k < span_count; k++)
+	{
+		t_segment *segment = spans[k].segment;
+
+		if (sequence < segment->first_sequence)
+			sequence = segment->first_sequence;
+		for (; sequence < spans[k].end; sequence++)
+		{
+			t_history_entry *entry = &segment->index[sequence - segment->first_sequence];
+
+			if (entry->room != client->room)
+				continue;
+			if (slice && slice->segment == segment && slice->bytes + slice->length == segment->data + entry->offset)
+			{
+				slice->length += entry->length;
+				continue;
+			}
+			if (slice)
+			{
+				outbound_insert(queue, position++, slice);
+				message_release(slice);
+			}
+			slice = message_create_slice(segment, entry->offset, entry->length);
+		}
+	}
+	for (k = 0; k < span_count; k++)
+		segment_release(spans[k].segment);
+	free(spans);
+	if (slice)
+	{
+		outbound_insert(queue, position++, slice);
+		message_release(slice);
+	}
+
+	char notice[64];
+	int length = snprintf(notice, sizeof(notice), "server: replayed up to %lu\n", last - 1);
+	t_message *message = message_create(notice, length, NULL, 0);
+
+	outbound_insert(queue, position, message);
+	message_release(message);
+	STAT_ADD(history_replays, 1);
+	if (!client->write_armed)
+		schedule_flush(client);
+}
+
+// ============================================================================
+// NODE LINKS
+// ============================================================================
+
+// Register a link connection, dialed from MINI_SERV_PEERS entry peer_index
+// or accepted (-1). The caller watches fd. Both ends start with a hello.
+t_client *link_open(int fd, int peer_index)
+{
+	t_client *client = client_record_alloc();
+	t_link *link = calloc(1, sizeof(*link));
+	t_message *hello;
+
+	if (link == NULL)
+		fatal_error(NULL);
+	link->client = client;
+	link->node = -1;
+	link->peer_index = peer_index;
+	client->fd = fd;
+	client->client_id = -1;
+	client->binary = 1;
+	client->link = link;
+	registry_add(client);
+	links = grow_pointer_array(links, &link_capacity, link_count + 1);
+	links[link_count++] = link;
+
+	hello = message_create_frame(FRAME_HELLO, config.node_id, NULL, 0);
+	outbound_push(&client->outbound, hello, 0);
+	message_release(hello);
+	schedule_flush(client);
+	return client;
+}
+
+// Forget a link whose connection is being cleaned up
+void link_close(t_link *link)
+{
+	for (size_t i = 0; i < link_count; i++)
+	{
+		if (links[i] == link)
+		{
+			links[i] = links[--link_count];
+			break;
+		}
+	}
+	if (link->node >= 0)
+		__atomic_sub_fetch(&links_up, 1, __ATOMIC_SEQ_CST);
+	// Lines the peer was streaming end here, as for a local sender leaving
+	while (link->stream_count > 0)
+		broadcast_link_stream(link, FRAME_STREAM_END, link->streams[0].sender, link->streams[0].room, "", 0);
+	free(link->streams);
+	inbound_clear(&link->batch, 0);
+	free(link);
+}
+
+// Peers run on this host, so connect() completes or fails right away
+void link_dial(int peer_index)
+{
+	struct sockaddr_in address;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return;
+	bzero(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr = config.bind_address;
+	if (address.sin_addr.s_addr == htonl(INADDR_ANY))
+		address.sin_addr.s_addr = htonl(LOCALHOST_IP);
+	address.sin_port = htons(config.peer_ports[peer_index]);
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+		(config.backend != BACKEND_IO_URING && event_add(fd) < 0))
+	{
+		close(fd);
+		return; // Tried again by the next link timer tick
+	}
+	set_nonblocking(fd);
+
+	t_client *client = link_open(fd, peer_index);
+	if (config.backend == BACKEND_IO_URING)
+		uring_arm_recv(client);
+}
+
+// Dial every MINI_SERV_PEERS entry that has no link, by connection or by node
+void link_redial(void)
+{
+	for (int i = 0; i < config.peer_count; i++)
+	{
+		int linked = 0;
+
+		for (size_t j = 0; j < link_count; j++)
+		{
+			if (links[j]->peer_index == i || (peer_nodes[i] >= 0 && links[j]->node == peer_nodes[i]))
+				linked = 1;
+		}
+		if (!linked)
+			link_dial(i);
+	}
+}
+
+void link_timer_expired(void)
+{
+	uint64_t expirations;
+
+	read(link_timer_fd, &expirations, sizeof(expirations));
+	link_redial();
+}
+
+// ============================================================================
+// STREAMED LINES
+// ============================================================================
+
+// Broadcast the next piece of sender's oversized line. Text clients get the
+// bytes as they are, the first chunk after the sender's prefix; binary clients
+// get every chunk as a message frame of its own, and node links as a stream
+// entry. Streamed lines are not logged to the history.
+void stream_chunk(t_client *sender, const char *data, size_t length, int last)
+{
+	int first = sender->stream_out == 0;
+	t_message *text = NULL;
+	t_message *binary = NULL;
+	t_message *message;
+
+	if (first)
+	{
+		if (sender->arrival_batch == presence_batch)
+			presence_flush();
+		sender->stream_out = __atomic_add_fetch(&stream_clock, 1, __ATOMIC_RELAXED);
+		sender->line_tokens--;
+	}
+	if (config.stream_stall_usec > 0)
+	{
+		sender->stream_usec = monotonic_usec();
+		if (first)
+			stream_watch(sender);
+		else if (last)
+			timer_cancel(&sender->stream_timer);
+	}
+	if (peers_connected(0))
+		text = message_create(sender->prefix, first ? sender->prefix_length : 0, data, length);
+	if ((peers_connected(1) || links_connected()) && length > (size_t)last)
+		binary = message_create_frame(FRAME_MESSAGE, sender->client_id, data, length - last);
+	message = message_pair(text, binary);
+	message->room = sender->room;
+	message->stream = sender->stream_out;
+	message->stream_end = last;
+	message->sender = sender->client_id;
+	broadcast_to_all_except(sender, message);
+	message_release(message);
+	STAT_ADD(stream_chunks, 1);
+	if (last)
+	{
+		sender->stream_out = 0;
+		STAT_ADD(messages_in, 1);
+	}
+}
+
+// Stream the partial line once it outgrows the threshold
+void stream_if_oversized(t_client *client)
+{
+	t_inbound *pending = &client->inbound;
+
+	if (config.stream_threshold > 0 && pending->length >= (size_t)config.stream_threshold)
+	{
+		stream_chunk(client, pending->data, pending->length, 0);
+		inbound_clear(pending, 0);
+	}
+}
+
+// ============================================================================
+// SHARED MEMORY RINGS
+// ============================================================================
+
+// "/ring": map a fresh ring for client and have the next flush announce it.
+// Returns -1, with nothing left behind, if the fds or memory are not there.
+int ring_open(t_client *client)
+{
+	t_ring *ring = calloc(1, sizeof(*ring));
+	size_t mapping = RING_HEADER_SIZE + config.ring_size;
+
+	if (ring == NULL)
+		fatal_error(NULL);
+	ring->header = MAP_FAILED;
+	ring->memfd = memfd_create("mini_serv ring", MFD_CLOEXEC);
+	ring->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->memfd >= 0 && ftruncate(ring->memfd, mapping) == 0)
+		ring->header = mmap(NULL, mapping, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+	if (ring->header == MAP_FAILED || ring->wake_fd < 0 || ring->space_fd < 0 || event_add(ring->space_fd) < 0)
+	{
+		if (ring->header != MAP_FAILED)
+			munmap(ring->header, mapping);
+		if (ring->memfd >= 0)
+			close(ring->memfd);
+		if (ring->wake_fd >= 0)
+			close(ring->wake_fd);
+		if (ring->space_fd >= 0)
+			close(ring->space_fd);
+		free(ring);
+		return -1;
+	}
+	ring->header->size = config.ring_size;
+	ring->data = (char *)ring->header + RING_HEADER_SIZE;
+	ring->size = config.ring_size;
+	client->ring = ring;
+
+	// The space eventfd leads back to its client like the socket does
+	registry.by_fd = grow_pointer_array(registry.by_fd, &registry.fd_capacity, ring->space_fd + 1);
+	registry.by_fd[ring->space_fd] = client;
+	if (config.backend == BACKEND_IO_URING)
+		uring_arm_ring(client);
+	schedule_flush(client);
+	return 0;
+}
+
+// Wake the client the way it asked to be woken, how being the
+// consumer_waiting value taken from the header
+void ring_wake(t_ring *ring, uint32_t how)
+{
+	uint64_t one = 1;
+
+	if (how == RING_WAIT_FUTEX)
+	{
+		__atomic_add_fetch(&ring->header->wake_sequence, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &ring->header->wake_sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+	else if (how == RING_WAIT_EVENTFD)
+		write(ring->wake_fd, &one, sizeof(one));
+	else
+		return;
+	STAT_ADD(ring_wakeups, 1);
+}
+
+// Called with RING_READY sent, or not: sent is what sendmsg() returned
+void ring_ready_sent(t_client *client, ssize_t sent)
+{
+	t_ring *ring = client->ring;
+
+	if (client->write_armed)
+	{
+		client->write_armed = 0;
+		event_watch_writable(client->fd, 0);
+	}
+	if (sent != (ssize_t)strlen(RING_READY))
+	{
+		disconnect_later(client); // Peer gone, or RING_READY cut short
+		return;
+	}
+	ring->announced = 1;
+	close(ring->memfd); // The client has its own copy, the mapping stays
+	ring->memfd = -1;
+}
+
+// Send RING_READY with the memfd and both eventfds attached. Everything
+// queued behind it goes to the ring. Returns 1 once it went out.
+int ring_announce(t_client *client)
+{
+	t_ring *ring = client->ring;
+	int fds[3] = {ring->memfd, ring->wake_fd, ring->space_fd};
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct msghdr header;
+	struct iovec iov;
+	struct cmsghdr *message;
+	ssize_t sent;
+
+	if (config.backend == BACKEND_IO_URING)
+	{
+		uring_arm_ring_ready(client, fds);
+		return 0;
+	}
+	bzero(&header, sizeof(header));
+	bzero(control, sizeof(control));
+	iov.iov_base = RING_READY;
+	iov.iov_len = strlen(RING_READY);
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+	message = CMSG_FIRSTHDR(&header);
+	message->cmsg_level = SOL_SOCKET;
+	message->cmsg_type = SCM_RIGHTS;
+	message->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(message), fds, sizeof(fds));
+	do
+		sent = sendmsg(client->fd, &header, MSG_NOSIGNAL);
+	while (sent < 0 && errno == EINTR);
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		// Socket full of earlier output: try again once it drains
+		if (!client->write_armed)
+		{
+			client->write_armed = 1;
+			event_watch_writable(client->fd, 1);
+		}
+		return 0;
+	}
+	ring_ready_sent(client, sent);
+	return ring->announced;
+}
+
+// Copy as much of client's queue into its ring as fits, then wake the client
+// if it sleeps. A full ring sets producer_waiting; the client signals
+// space_fd once it read something, which flushes again. The client can write
+// the whole header, so head is checked before it sizes a copy.
+void ring_flush(t_client *client)
+{
+	t_ring *ring = client->ring;
+	t_outbound *queue = &client->outbound;
+	uint64_t tail = ring->tail;
+	size_t copied = 0, messages = 0;
+
+	if (client->evicted || client->send_in_flight)
+		return; // Leaving, or io_uring is still sending; its completion calls back
+	if (!ring->announced && !ring_announce(client))
+		return;
+	while (queue->count > 0)
+	{
+		uint64_t head = __atomic_load_n(&ring->header->head, __ATOMIC_SEQ_CST);
+		size_t room;
+
+		if (tail - head > ring->size)
+		{
+			disconnect_later(client); // head is not between tail - size and tail
+			return;
+		}
+		room = ring->size - (tail - head);
+		if (room == 0)
+		{
+			// Ask for a signal, then look at head again in case the client
+			// read meanwhile and missed the flag
+			if (__atomic_load_n(&ring->header->producer_waiting, __ATOMIC_RELAXED))
+			{
+				STAT_ADD(ring_fills, 1);
+				break;
+			}
+			__atomic_store_n(&ring->header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		t_message *message = queue->entries[queue->head & (queue->capacity - 1)];
+		size_t length = message->length - queue->head_offset;
+		size_t position = tail & (ring->size - 1);
+		size_t first;
+
+		// room is at most size, so both pieces stay inside the data area
+		if (length > room)
+			length = room;
+		else
+			messages++;
+		first = ring->size - position < length ? ring->size - position : length;
+		memcpy(ring->data + position, message->bytes + queue->head_offset, first);
+		memcpy(ring->data, message->bytes + queue->head_offset + first, length - first);
+		tail += length;
+		copied += length;
+		outbound_consume(queue, length);
+	}
+	if (copied == 0)
+		return;
+	ring->tail = tail;
+	__atomic_store_n(&ring->header->tail, tail, __ATOMIC_SEQ_CST);
+	STAT_ADD(flush_messages, messages);
+	STAT_ADD(flush_bytes, copied);
+	if (__atomic_load_n(&ring->header->consumer_waiting, __ATOMIC_SEQ_CST))
+		ring_wake(ring, __atomic_exchange_n(&ring->header->consumer_waiting, 0, __ATOMIC_SEQ_CST));
+}
+
+// The client made room after finding producer_waiting set
+void ring_space_signalled(t_client *client)
+{
+	uint64_t count;
+
+	read(client->ring->space_fd, &count, sizeof(count));
+	ring_flush(client);
+}
+
+// The client is leaving: mark the ring closed for a client that still maps
+// it, wake it if it sleeps, and let go of the server's side
+void ring_close(t_client *client)
+{
+	t_ring *ring = client->ring;
+
+	__atomic_store_n(&ring->header->closed, 1, __ATOMIC_SEQ_CST);
+	ring_wake(ring, __atomic_exchange_n(&ring->header->consumer_waiting, 0, __ATOMIC_SEQ_CST));
+	event_remove(ring->space_fd);
+	registry.by_fd[ring->space_fd] = NULL;
+	if (config.backend == BACKEND_IO_URING)
+		uring_cancel((unsigned long)client | URING_OP_WAKE);
+	munmap(ring->header, RING_HEADER_SIZE + ring->size);
+	if (ring->memfd >= 0)
+		close(ring->memfd);
+	close(ring->wake_fd);
+	close(ring->space_fd);
+	free(ring);
+	client->ring = NULL;
+}
+
+// ============================================================================
+// CLIENT MANAGEMENT
+// ============================================================================
+
+t_client *register_client(int client_fd, int client_id, int binary)
+{
+	t_client *client = client_record_alloc();
+
+	client->fd = client_fd;
+	client->binary = binary;
+	client->arrival_sequence = __atomic_load_n(&history_next_sequence, __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&peer_counts[binary], 1, __ATOMIC_SEQ_CST);
+	client->client_id = client_id;
+	client->prefix_length = snprintf(client->prefix, PREFIX_SIZE, "client %d: ", client->client_id);
+	client->line_tokens = config.rate_lines;
+	client->byte_tokens = config.rate_bytes;
+	client->tokens_usec = monotonic_usec();
+	client->active_usec = client->tokens_usec;
+	client->idle_timer.kind = TIMER_IDLE;
+	client->stream_timer.kind = TIMER_STREAM;
+	if (config.idle_usec > 0)
+		idle_watch(client);
+	if (config.busy_poll_usec > 0)
+	{
+		int busy_poll = config.busy_poll_usec;
+
+		// Spin on the device queue too; above net.core.busy_read this needs CAP_NET_ADMIN
+		setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+	}
+	registry_add(client);
+	room_add(client, LOBBY_ROOM);
+	return client;
+}
+
+t_client *initialize_new_client(int client_fd, int binary)
+{
+	STAT_ADD(accepts, 1);
+	return register_client(client_fd, __atomic_fetch_add(&next_client_id, 1, __ATOMIC_RELAXED), binary);
+}
+
+void cleanup_client(t_client *client)
+{
+	STAT_ADD(departures, 1);
+	timer_cancel(&client->idle_timer);
+	timer_cancel(&client->stream_timer);
+	if (client->stream_out)
+		stream_chunk(client, "\n", 1, 1); // Its recipients wait for the end of the line
+	for (size_t i = 0; i < client->stream_held_count; i++)
+		message_release(client->stream_held[i]);
+	free(client->stream_held);
+	client->stream_held = NULL;
+	client->stream_held_count = client->stream_held_capacity = 0;
+	client->stream_held_bytes = 0;
+	client->stream_open = 0;
+	event_remove(client->fd);
+	if (client->ring)
+		ring_close(client);
+	inbound_clear(&client->inbound, 1);
+	outbound_clear(&client->outbound);
+	registry_remove(client);
+	if (client->link)
+		link_close(client->link);
+	else
+	{
+		room_remove(client);
+		__atomic_sub_fetch(&peer_counts[client->binary], 1, __ATOMIC_SEQ_CST);
+	}
+	client->link = NULL;
+	client->closing = 1;
+	// Pending io_uring recv/send requests complete once the socket is shut down
+	if (client->uring_inflight > 0)
+		shutdown(client->fd, SHUT_RDWR);
+	close(client->fd);
+	client_record_release(client);
+}
+
+// ============================================================================
+// MESSAGE PROCESSING
+// ============================================================================
+
+// Format the line once per kind of recipient; every recipient queues a
+// reference to the same bytes. Binary clients get it without the newline.
+void broadcast_client_message(t_client *sender, const char *line, size_t length)
+{
+	t_message *text = NULL;
+	t_message *binary = NULL;
+	t_message *message;
+
+	if (sender->arrival_batch == presence_batch)
+		presence_flush(); // Its arrival is announced before its first line
+	if (peers_connected(0) || config.history_dir)
+		text = message_create(sender->prefix, sender->prefix_length, line, length);
+	if (peers_connected(1) || links_connected())
+		binary = message_create_frame(FRAME_MESSAGE, sender->client_id, line, length - 1);
+	message = message_pair(text, binary);
+	message->room = sender->room;
+	if (config.history_dir)
+		message->sequence = history_append(message, sender->room);
+	broadcast_to_all_except(sender, message);
+	message_release(message);
+}
+
+// Room names are 1 to ROOM_NAME_MAX - 1 printable characters without spaces
+int room_name_valid(const char *name, size_t length)
+{
+	if (length == 0 || length >= ROOM_NAME_MAX)
+		return 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		if ((unsigned char)name[i] <= ' ' || name[i] == 127)
+			return 0;
+	}
+	return 1;
+}
+
+// "/join <name>"
+int handle_join_line(t_client *client, const char *line, size_t length)
+{
+	const char *name = line + 6;
+	size_t name_length = length - 7; // Without "/join " and the newline
+
+	if (name[name_length - 1] == '\r')
+		name_length--;
+	if (!room_name_valid(name, name_length))
+		return 0;
+	room_join(client, room_intern(name, name_length));
+	return 1;
+}
+
+// "/replay <count>" or "/replay since <sequence>"
+int handle_replay_line(t_client *client, const char *line, size_t length)
+{
+	const char *argument = line + 8;
+	size_t argument_length = length - 9; // Without "/replay " and the newline
+	char number[32];
+	char *end;
+	unsigned long value;
+	int since;
+
+	if (argument[argument_length - 1] == '\r')
+		argument_length--;
+	since = argument_length > 6 && memcmp(argument, "since ", 6) == 0;
+	if (since)
+	{
+		argument += 6;
+		argument_length -= 6;
+	}
+	if (argument_length == 0 || argument_length >= sizeof(number) || *argument < '0' || *argument > '9')
+		return 0;
+	memcpy(number, argument, argument_length);
+	number[argument_length] = '\0';
+	value = strtoul(number, &end, 10);
+	if (*end != '\0')
+		return 0;
+	if (since)
+		history_replay(client, value, ULONG_MAX);
+	else
+		history_replay(client, 1, value);
+	return 1;
+}
+
+// "/ring" from a Unix socket client; it is told if no ring can be had
+int handle_ring_line(t_client *client)
+{
+	const char *refusal = "server: ring unavailable\n";
+	t_message *message;
+
+	if (client->ring || ring_open(client) == 0)
+		return 1;
+	message = message_create(NULL, 0, refusal, strlen(refusal));
+	send_to_client(client, message);
+	message_release(message);
+	return 1;
+}
+
+// Control lines: "/join" when MINI_SERV_ROOMS is on, "/replay" when the
+// history log is, "/ping" with idle reaping and "/ring" from Unix socket
+// clients while rings are on. Returns 0 for any other line, malformed ones
+// included, so those are broadcast as text.
+int handle_control_line(t_client *client, const char *line, size_t length)
+{
+	if (config.rooms && length >= 8 && memcmp(line, "/join ", 6) == 0)
+		return handle_join_line(client, line, length);
+	if (config.history_dir && length >= 10 && memcmp(line, "/replay ", 8) == 0)
+		return handle_replay_line(client, line, length);
+	if (config.idle_usec > 0 && length == 6 && memcmp(line, "/ping\n", 6) == 0)
+		return 1; // Keepalive: it counted as activity, nobody else needs it
+	if (config.ring_size > 0 && client->local && length == 6 && memcmp(line, "/ring\n", 6) == 0)
+		return handle_ring_line(client);
+	return 0;
+}
+
+void process_client_line(t_client *client, const char *line, size_t length)
+{
+	STAT_ADD(messages_in, 1);
+	client->line_tokens--;
+	if (!handle_control_line(client, line, length))
+		broadcast_client_message(client, line, length);
+}
+
+// Split freshly received bytes into lines. Every byte is scanned once with
+// memchr(); lines that lie entirely in data are broadcast as slices of it, and
+// only a trailing partial line is copied into the client's inbound buffer.
+void frame_received_data(t_client *client, const char *data, size_t length)
+{
+	t_inbound *pending = &client->inbound;
+	const char *end = data + length;
+	const char *newline;
+
+	// A streamed line is passed on up to its end as it arrives
+	if (client->stream_out)
+	{
+		newline = memchr(data, '\n', length);
+		stream_chunk(client, data, newline ? (size_t)(newline + 1 - data) : length, newline != NULL);
+		if (newline == NULL)
+			return;
+		data = newline + 1;
+	}
+	// Complete the line carried over from earlier reads first
+	else if (pending->length > 0)
+	{
+		newline = memchr(data, '\n', length);
+		if (newline == NULL)
+		{
+			inbound_append(pending, data, length);
+			stream_if_oversized(client);
+			return;
+		}
+		inbound_append(pending, data, newline + 1 - data);
+		process_client_line(client, pending->data, pending->length);
+		inbound_clear(pending, 1);
+		data = newline + 1;
+	}
+
+	while (data < end && (newline = memchr(data, '\n', end - data)) != NULL)
+	{
+		process_client_line(client, data, newline + 1 - data);
+		data = newline + 1;
+	}
+
+	if (data < end)
+	{
+		inbound_append(pending, data, end - data);
+		stream_if_oversized(client);
+	}
+}
+
+// ============================================================================
+// BINARY FRAMING
+// ============================================================================
+
+// Disconnect a binary client or node link that sent something unparseable
+void reject_client(t_client *client)
+{
+	if (disconnect_later(client))
+		STAT_ADD(protocol_errors, 1);
+}
+
+// Header plus payload size of the frame starting at data, 0 if it is too
+// large. Node links are trusted with batches of any size.
+size_t frame_size(t_client *client, const char *data)
+{
+	t_frame_header header;
+
+	memcpy(&header, data, sizeof(header));
+	if (ntohl(header.length) > FRAME_MAX_PAYLOAD && !client->link)
+		return 0;
+	return sizeof(header) + ntohl(header.length);
+}
+
+// A payload from a binary client is forwarded to binary peers as received,
+// with only the sender id filled in; text peers get it line by line
+void broadcast_client_frame(t_client *sender, const char *payload, size_t length)
+{
+	t_message *text = NULL;
+	t_message *binary = NULL;
+	t_message *message;
+
+	if (sender->arrival_batch == presence_batch)
+		presence_flush(); // Its arrival is announced before its first line
+	if (peers_connected(0) || config.history_dir)
+		text = message_create_text_lines(sender->prefix, sender->prefix_length, payload, length);
+	if (peers_connected(1) || links_connected())
+		binary = message_create_frame(FRAME_MESSAGE, sender->client_id, payload, length);
+	message = message_pair(text, binary);
+	message->room = sender->room;
+	if (config.history_dir)
+		message->sequence = history_append(message, sender->room);
+	broadcast_to_all_except(sender, message);
+	message_release(message);
+}
+
+// A hello names the node at the other end. Should two links to one node come
+// up (both listed each other), both ends keep the one the lower node id dialed.
+void process_link_hello(t_client *client, int node)
+{
+	t_link *link = client->link;
+
+	if (link->node >= 0 || node < 0 || node > MAX_NODE_ID || node == config.node_id)
+	{
+		reject_client(client);
+		return;
+	}
+	if (link->peer_index >= 0)
+		peer_nodes[link->peer_index] = node;
+	for (size_t i = 0; i < link_count; i++)
+	{
+		t_link *other = links[i];
+
+		if (other == link || other->node != node)
+			continue;
+		if ((link->peer_index >= 0) != (config.node_id < node))
+		{
+			disconnect_later(client);
+			return;
+		}
+		other->node = -1;
+		__atomic_sub_fetch(&links_up, 1, __ATOMIC_SEQ_CST);
+		disconnect_later(other->client);
+	}
+	link->node = node;
+	__atomic_add_fetch(&links_up, 1, __ATOMIC_SEQ_CST);
+}
+
+// Broadcast one entry of another node's batch to the clients here. It is
+// rendered and logged like a local broadcast, but not forwarded to links.
+void broadcast_link_entry(int type, int sender_id, const char *room_name, size_t room_length,
+						  const char *payload, size_t length)
+{
+	int room = LOBBY_ROOM;
+	t_message *message;
+
+	if (room_length > 0)
+	{
+		if (!config.rooms)
+			return; // Nobody here can be in that room
+		room = room_intern(room_name, room_length);
+	}
+	if (type != FRAME_MESSAGE && config.presence_batch)
+	{
+		presence_queue(type, sender_id, room, 1);
+		STAT_ADD(link_entries, 1);
+		return;
+	}
+	if (type == FRAME_MESSAGE)
+	{
+		t_message *text = NULL;
+		t_message *binary = NULL;
+		char prefix[PREFIX_SIZE];
+		int prefix_length = snprintf(prefix, sizeof(prefix), "client %d: ", sender_id);
+
+		// The sender's arrival may be among the held ones
+		if (presence_remote_count > 0)
+			presence_flush();
+
+		if (peers_connected(0) || config.history_dir)
+			text = message_create_text_lines(prefix, prefix_length, payload, length);
+		if (peers_connected(1))
+			binary = message_create_frame(FRAME_MESSAGE, sender_id, payload, length);
+		message = message_pair(text, binary);
+		message->room = room;
+		if (config.history_dir)
+			message->sequence = history_append(message, room);
+	}
+	else if (type == FRAME_ARRIVED)
+		message = message_create_notice("server: client %d just arrived\n", FRAME_ARRIVED, sender_id, room);
+	else
+		message = message_create_notice("server: client %d just left\n", FRAME_LEFT, sender_id, room);
+	message->remote = 1;
+	broadcast_to_all_except(NULL, message);
+	message_release(message);
+	STAT_ADD(link_entries, 1);
+}
+
+// Broadcast a piece of a line the peer is streaming as a streamed line of
+// this node, the first piece after the sender's prefix. A line whose start
+// was never seen (the link came up, or this process took over, mid-line)
+// begins at the piece that arrived.
+void broadcast_link_stream(t_link *link, int type, int sender_id, int room, const char *payload, size_t length)
+{
+	int last = type == FRAME_STREAM_END;
+	t_message *text = NULL;
+	t_message *binary = NULL;
+	t_message *message;
+	char prefix[PREFIX_SIZE];
+	int prefix_length = 0;
+	size_t i = 0;
+
+	while (i < link->stream_count && link->streams[i].sender != sender_id)
+		i++;
+	if (i == link->stream_count)
+	{
+		if (last && length == 0)
+			return; // Nothing of the line was passed on here
+		if (presence_remote_count > 0)
+			presence_flush();
+		link->streams = grow_array(link->streams, &link->stream_capacity, link->stream_count + 1,
+								   sizeof(*link->streams));
+		link->streams[i].sender = sender_id;
+		link->streams[i].room = room;
+		link->streams[i].stream = __atomic_add_fetch(&stream_clock, 1, __ATOMIC_RELAXED);
+		link->stream_count++;
+		prefix_length = snprintf(prefix, sizeof(prefix), "client %d: ", sender_id);
+	}
+	if (peers_connected(0))
+	{
+		text = message_create(prefix, prefix_length, NULL, length + last);
+		memcpy(text->data + prefix_length, payload, length);
+		if (last)
+			text->data[prefix_length + length] = '\n';
+	}
+	if (peers_connected(1) && length > 0)
+		binary = message_create_frame(FRAME_MESSAGE, sender_id, payload, length);
+	message = message_pair(text, binary);
+	message->room = link->streams[i].room;
+	message->remote = 1;
+	message->stream = link->streams[i].stream;
+	message->stream_end = last;
+	message->sender = sender_id;
+	if (last)
+		link->streams[i] = link->streams[--link->stream_count];
+	broadcast_to_all_except(NULL, message);
+	message_release(message);
+	STAT_ADD(link_entries, 1);
+}
+
+void process_link_batch(t_client *client, const char *payload, size_t length)
+{
+	const char *end = payload + length;
+	t_frame_header header;
+
+	if (client->link->node < 0)
+	{
+		reject_client(client); // Batches only follow the hello
+		return;
+	}
+	while (payload < end)
+	{
+		const char *room_name = payload + sizeof(header);
+		size_t room_length, entry_length;
+		int type;
+
+		if ((size_t)(end - payload) < sizeof(header))
+		{
+			reject_client(client);
+			return;
+		}
+		memcpy(&header, payload, sizeof(header));
+		type = ntohs(header.type);
+		room_length = ntohs(header.reserved);
+		entry_length = ntohl(header.length);
+		if ((size_t)(end - room_name) < room_length + entry_length ||
+			(room_length > 0 && !room_name_valid(room_name, room_length)) ||
+			(type != FRAME_MESSAGE && type != FRAME_ARRIVED && type != FRAME_LEFT &&
+			 type != FRAME_STREAM && type != FRAME_STREAM_END) ||
+			((type == FRAME_STREAM || type == FRAME_STREAM_END) &&
+			 memchr(room_name + room_length, '\n', entry_length)))
+		{
+			reject_client(client);
+			return;
+		}
+		if (type == FRAME_STREAM || type == FRAME_STREAM_END)
+		{
+			// Ignored while rooms are off, like any entry for a room
+			if (room_length == 0 || config.rooms)
+				broadcast_link_stream(client->link, type, ntohl(header.sender),
+									  room_length > 0 ? room_intern(room_name, room_length) : LOBBY_ROOM,
+									  room_name + room_length, entry_length);
+		}
+		else
+			broadcast_link_entry(type, ntohl(header.sender), room_name, room_length,
+								 room_name + room_length, entry_length);
+		payload = room_name + room_length + entry_length;
+	}
+}
+
+void process_link_frame(t_client *client, const char *frame)
+{
+	t_frame_header header;
+
+	memcpy(&header, frame, sizeof(header));
+	if (ntohs(header.type) == FRAME_HELLO && header.length == 0)
+		process_link_hello(client, ntohl(header.sender));
+	else if (ntohs(header.type) == FRAME_BATCH)
+		process_link_batch(client, frame + sizeof(header), ntohl(header.length));
+	else
+		reject_client(client);
+}
+
+void process_client_frame(t_client *client, const char *frame)
+{
+	t_frame_header header;
+	const char *payload = frame + sizeof(header);
+	size_t length;
+
+	if (client->link)
+	{
+		process_link_frame(client, frame);
+		return;
+	}
+	memcpy(&header, frame, sizeof(header));
+	length = ntohl(header.length);
+	STAT_ADD(messages_in, 1);
+	client->line_tokens--;
+	if (ntohs(header.type) == FRAME_MESSAGE)
+		broadcast_client_frame(client, payload, length);
+	else if (ntohs(header.type) == FRAME_JOIN)
+	{
+		// Ignored while rooms are off or for a malformed name, like "/join"
+		if (config.rooms && room_name_valid(payload, length))
+			room_join(client, room_intern(payload, length));
+	}
+	else
+		reject_client(client);
+}
+
+// Split freshly received bytes into frames. The header gives each frame's
+// size, so nothing is scanned: frames that lie entirely in data are handled
+// in place, and only a trailing partial frame is copied into the client's
+// inbound buffer.
+void binary_received_data(t_client *client, const char *data, size_t length)
+{
+	t_inbound *pending = &client->inbound;
+	const char *end = data + length;
+	size_t size, take;
+
+	if (client->evicted)
+		return;
+	// Complete the frame carried over from earlier reads first
+	if (pending->length > 0)
+	{
+		if (pending->length < sizeof(t_frame_header))
+		{
+			take = sizeof(t_frame_header) - pending->length;
+			take = take < length ? take : length;
+			inbound_append(pending, data, take);
+			data += take;
+			if (pending->length < sizeof(t_frame_header))
+				return;
+		}
+		size = frame_size(client, pending->data);
+		if (size == 0)
+		{
+			reject_client(client);
+			return;
+		}
+		take = size - pending->length < (size_t)(end - data) ? size - pending->length : (size_t)(end - data);
+		inbound_append(pending, data, take);
+		data += take;
+		if (pending->length < size)
+			return;
+		process_client_frame(client, pending->data);
+		inbound_clear(pending, 1);
+	}
+
+	while (!client->evicted && (size_t)(end - data) >= sizeof(t_frame_header))
+	{
+		size = frame_size(client, data);
+		if (size == 0)
+		{
+			reject_client(client);
+			return;
+		}
+		if ((size_t)(end - data) < size)
+			break;
+		process_client_frame(client, data);
+		data += size;
+	}
+
+	if (!client->evicted && data < end)
+		inbound_append(pending, data, end - data);
+}
+
+// Hand received bytes to the parser of the client's protocol
+void client_received_data(t_client *client, const char *data, size_t length)
+{
+	if (handing_over)
+		inbound_append(&client->inbound, data, length); // Parsed by the new process
+	else if (client->binary)
+		binary_received_data(client, data, length);
+	else
+		frame_received_data(client, data, length);
+}
+
+// ============================================================================
+// WRITE COALESCING
+// ============================================================================
+
+// Hand every scheduled client's queued output to the kernel in one call per
+// client: a sendmsg() for select/epoll, one SENDMSG SQE for io_uring so the
+// whole fan-out goes out with the next io_uring_enter()
+void flush_scheduled_clients(void)
+{
+	// Held arrivals and departures go out with this flush, including those
+	// of the clients it evicts
+	for (size_t i = 0; i < flush_count || presence_count > 0; i++)
+	{
+		if (i == flush_count)
+		{
+			presence_flush();
+			if (i == flush_count)
+				break; // Nobody here to tell
+		}
+
+		t_client *client = flush_list[i];
+
+		client->flush_scheduled = 0;
+		if (client->link && client->link->batch.length > 0 && !client->closing)
+			link_seal_batch(client->link);
+		if (client->closing)
+			client_record_release(client);
+		else if (client->evicted)
+		{
+			notify_client_departure(client);
+			cleanup_client(client);
+		}
+		else if (client->ring)
+			ring_flush(client);
+		else if (config.backend != BACKEND_IO_URING)
+			flush_outbound(client);
+		else if (!client->send_in_flight && client->outbound.count > 0 && !handing_over)
+			uring_arm_send(client);
+	}
+	flush_count = 0;
+}
+
+void flush_window_expired(void)
+{
+	uint64_t expirations;
+
+	read(flush_timer_fd, &expirations, sizeof(expirations));
+	flush_timer_armed = 0;
+	flush_scheduled_clients();
+}
+
+// ============================================================================
+// CONNECTION HANDLING
+// ============================================================================
+
+// Out of fds: give up the reserve fd for long enough to accept the oldest
+// pending connection and close it, instead of leaving it queued for the
+// listener to report again and again
+int shed_connection(int listener)
+{
+	int fd;
+
+	if (reserve_fd < 0)
+		reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // Lost to another thread last time
+	if (reserve_fd < 0)
+		return 0;
+	close(reserve_fd);
+	fd = accept(listener, NULL, NULL);
+	if (fd >= 0)
+	{
+		close(fd);
+		STAT_ADD(accept_sheds, 1);
+	}
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return fd >= 0;
+}
+
+// Select reports a listener with a queue again by itself, edge-triggered
+// epoll does not
+void carry_listener(int listener)
+{
+	if (config.backend != BACKEND_EPOLL)
+		return;
+	for (int i = 0; i < carried_listener_count; i++)
+		if (carried_listeners[i] == listener)
+			return;
+	carried_listeners[carried_listener_count++] = listener;
+}
+
+void handle_new_connection(int listener)
+{
+	int new_client_fd;
+
+	// The listening socket is non-blocking: drain the accept queue, up to
+	// this wakeup's batch so connected clients are not kept waiting
+	for (long accepted = 0;; accepted++)
+	{
+		if (accepted == config.accept_batch)
+		{
+			carry_listener(listener);
+			return;
+		}
+		// Sends must never stall the loop, so clients start non-blocking
+		new_client_fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_client_fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		if (new_client_fd < 0 && (errno == EMFILE || errno == ENFILE) && shed_connection(listener))
+			continue;
+		if (new_client_fd < 0)
+			return; // Queue drained (EAGAIN), or no fds left to shed with
+
+		// Add client to monitoring
+		if (event_add(new_client_fd) < 0)
+		{
+			close(new_client_fd);
+			continue;
+		}
+
+		if (listener == peer_socket)
+		{
+			link_open(new_client_fd, -1);
+			continue;
+		}
+
+		// Lines other workers broadcast before this client arrived must not
+		// reach it, so deliver whatever is already in the inbox first
+		if (config.worker_count > 1)
+			drain_worker_inbox();
+
+		// Initialize client data and notify other clients
+		t_client *client = initialize_new_client(new_client_fd, listener == binary_socket);
+
+		client->local = listener == unix_socket;
+		notify_client_arrival(client);
+	}
+}
+
+void handle_client_message(t_client *client)
+{
+	ssize_t bytes_received;
+	size_t turn_bytes = 0;
+	size_t allowance;
+
+	// Read until the socket is empty so edge-triggered epoll wakes us again,
+	// unless the client runs out of budget or tokens first
+	while (1)
+	{
+		if (reads_paused)
+		{
+			park_reader(client);
+			return;
+		}
+		if (turn_bytes >= (size_t)config.read_budget)
+		{
+			carry_reader(client);
+			return;
+		}
+		allowance = rate_read_allowance(client, sizeof(receive_buffer));
+		if (allowance == 0)
+		{
+			throttle_client(client);
+			return;
+		}
+		if (config.rate_lines > 0 && !client->binary && client->link == NULL)
+			allowance = line_rate_allowance(client, allowance);
+		bytes_received = recv(client->fd, receive_buffer, allowance, 0);
+
+		if (bytes_received < 0 && errno == EINTR)
+			continue;
+		if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return; // Nothing left to read
+
+		if (bytes_received <= 0) // Client disconnected
+		{
+			notify_client_departure(client);
+			cleanup_client(client);
+			return;
+		}
+
+		// Broadcast every complete line or frame, keep the unfinished tail
+		STAT_ADD(bytes_in, bytes_received);
+		client->active_usec = wakeup_usec;
+		turn_bytes += bytes_received;
+		client->byte_tokens -= bytes_received;
+		client_received_data(client, receive_buffer, bytes_received);
+
+		// A sender filling whole buffers could keep this loop busy for a long
+		// time; flush now so recipients' backlogs do not build up meanwhile
+		if ((size_t)bytes_received == sizeof(receive_buffer))
+		{
+			flush_scheduled_clients();
+			if (client->closing)
+				return; // Evicted by that flush
+		}
+	}
+}
+
+// Accept from the listeners whose batch ran out last time
+void serve_carried_listeners(void)
+{
+	int count = carried_listener_count;
+	int listeners[4];
+
+	memcpy(listeners, carried_listeners, sizeof(listeners));
+	carried_listener_count = 0;
+	for (int i = 0; i < count; i++)
+		handle_new_connection(listeners[i]);
+}
+
+// Give every carried reader another turn, in the order they ran out of budget
+void serve_carried_readers(void)
+{
+	t_client **carried = carried_list;
+	size_t count = carried_count;
+
+	carried_list = NULL;
+	carried_count = carried_capacity = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		t_client *client = carried[i];
+
+		client->read_carried = 0;
+		if (client->closing)
+			client_record_release(client);
+		else
+			handle_client_message(client);
+	}
+	free(carried);
+}
+
+// Read again from throttled clients whose buckets refilled, and set the
+// timer for the earliest of those still waiting
+void throttle_timer_expired(void)
+{
+	t_client **throttled = throttled_list;
+	size_t count = throttled_count;
+	uint64_t expirations;
+
+	read(throttle_timer_fd, &expirations, sizeof(expirations));
+	throttle_timer_usec = 0;
+	throttled_list = NULL;
+	throttled_count = throttled_capacity = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		t_client *client = throttled[i];
+
+		client->throttled = 0;
+		if (client->closing)
+			client_record_release(client);
+		else if (rate_read_allowance(client, 1) == 0)
+			throttle_client(client);
+		else if (config.backend == BACKEND_IO_URING)
+		{
+			if (client->recv_stopped)
+			{
+				client->recv_stopped = 0;
+				uring_arm_recv(client);
+			}
+		}
+		else
+		{
+			if (config.backend == BACKEND_SELECT)
+				FD_SET(client->fd, &master_set);
+			handle_client_message(client);
+		}
+	}
+	free(throttled);
+}
+
+void handle_ready_fd(int fd, int readable, int writable)
+{
+	if (fd == server_socket || fd == binary_socket || fd == peer_socket || fd == unix_socket)
+	{
+		handle_new_connection(fd);
+		return;
+	}
+	if (fd == link_timer_fd)
+	{
+		link_timer_expired();
+		return;
+	}
+	if (fd == throttle_timer_fd)
+	{
+		throttle_timer_expired();
+		return;
+	}
+	if (fd == idle_timer_fd)
+	{
+		idle_timer_expired();
+		return;
+	}
+	if (fd == current_worker->wake_fd)
+	{
+		drain_worker_inbox();
+		return;
+	}
+	if (fd == flush_timer_fd)
+	{
+		flush_window_expired();
+		return;
+	}
+	t_client *client = client_find_by_fd(fd);
+
+	if (client == NULL)
+		return; // Already disconnected earlier in this iteration
+	if (client->ring && fd == client->ring->space_fd)
+	{
+		ring_space_signalled(client);
+		return;
+	}
+	if (writable)
+		flush_outbound(client);
+	// epoll keeps reporting a throttled client; the throttle timer reads it
+	// once it is released, until the socket is empty
+	if (readable && !client->throttled)
+		handle_client_message(client);
+}
+
+// ============================================================================
+// EVENT DISPATCH
+// ============================================================================
+
+void run_select_iteration(void)
+{
+	struct timeval no_wait = {0, 0};
+
+	read_set = master_set;
+	write_set = master_write_set;
+
+	// Carried readers still have input, so only poll while there are any or
+	// while busy polling
+	int ready_count = select(highest_fd + 1, &read_set, &write_set, NULL,
+							 carried_count > 0 || busy_poll_spinning() ? &no_wait : NULL);
+
+	if (ready_count < 0)
+		return; // Select failed, try again
+	mark_wakeup();
+	busy_poll_result(ready_count > 0);
+
+	// Check all possible file descriptors
+	for (int fd = 0; fd <= highest_fd; fd++)
+	{
+		int readable = FD_ISSET(fd, &read_set);
+		int writable = FD_ISSET(fd, &write_set);
+
+		if (readable || writable)
+			handle_ready_fd(fd, readable, writable);
+	}
+}
+
+void run_epoll_iteration(void)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int ready_count;
+
+	ready_count = epoll_wait(epoll_fd, events, MAX_EVENTS,
+							 carried_count + carried_listener_count > 0 || busy_poll_spinning() ? 0 : -1);
+	if (ready_count < 0)
+		return; // Interrupted, try again
+	mark_wakeup();
+	busy_poll_result(ready_count > 0);
+
+	// Only the fds that actually have activity are visited
+	for (int i = 0; i < ready_count; i++)
+	{
+		// Errors and hangups are picked up by the read path
+		handle_ready_fd(events[i].data.fd,
+						(events[i].events & ~EPOLLOUT) != 0,
+						(events[i].events & EPOLLOUT) != 0);
+	}
+}
+
+// ============================================================================
+// IO_URING BACKEND
+// ============================================================================
+
+int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int ring_fd, unsigned opcode, void *argument, unsigned count)
+{
+	return syscall(__NR_io_uring_register, ring_fd, opcode, argument, count);
+}
+
+// Create the ring and map it; returns -1 (nothing left open) if the kernel refuses
+int uring_init(t_uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	size_t sq_size, cq_size;
+	char *sq_ring, *cq_ring;
+
+	bzero(ring, sizeof(*ring));
+	bzero(&params, sizeof(params));
+	params.flags = IORING_SETUP_CLAMP;
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0)
+		return -1;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+	{
+		close(ring->fd);
+		return -1;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+	sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				   ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+	cq_ring = sq_ring; // IORING_FEAT_SINGLE_MMAP: one mapping holds both rings
+
+	ring->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	return 0;
+}
+
+// Register URING_BUFFER_COUNT receive buffers the kernel picks from for recv
+int uring_init_buffers(t_uring *ring)
+{
+	struct io_uring_buf_reg registration;
+	size_t ring_size = sizeof(struct io_uring_buf) * URING_BUFFER_COUNT;
+
+	ring->buffer_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+							 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	if (ring->buffer_ring == MAP_FAILED || ring->buffers == NULL)
+		fatal_error(NULL);
+
+	bzero(&registration, sizeof(registration));
+	registration.ring_addr = (unsigned long)ring->buffer_ring;
+	registration.ring_entries = URING_BUFFER_COUNT;
+	registration.bgid = URING_BUFFER_GROUP;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+		return -1;
+
+	ring->buffer_tail = 0;
+	for (unsigned short id = 0; id < URING_BUFFER_COUNT; id++)
+	{
+		struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_tail++ & (URING_BUFFER_COUNT - 1)];
+
+		buffer->addr = (unsigned long)(ring->buffers + (size_t)id * URING_BUFFER_SIZE);
+		buffer->len = URING_BUFFER_SIZE;
+		buffer->bid = id;
+	}
+	__atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Hand a consumed receive buffer back to the kernel
+void uring_recycle_buffer(unsigned short id)
+{
+	struct io_uring_buf *buffer = &uring.buffer_ring->bufs[uring.buffer_tail++ & (URING_BUFFER_COUNT - 1)];
+
+	buffer->addr = (unsigned long)(uring.buffers + (size_t)id * URING_BUFFER_SIZE);
+	buffer->len = URING_BUFFER_SIZE;
+	buffer->bid = id;
+	__atomic_store_n(&uring.buffer_ring->tail, uring.buffer_tail, __ATOMIC_RELEASE);
+}
+
+// Submit without waiting. GETEVENTS with no minimum still runs the completion
+// work the kernel queued for this thread, so finished receives show up.
+void uring_poll(void)
+{
+	unsigned to_submit = uring.sq_local_tail - *uring.sq_tail;
+
+	__atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+	if (uring_enter(uring.fd, to_submit, 0, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN &&
+		errno != EBUSY)
+		fatal_error(NULL);
+}
+
+// Publish every SQE filled in so far and optionally wait for one completion
+void uring_submit(int wait)
+{
+	unsigned to_submit = uring.sq_local_tail - *uring.sq_tail;
+
+	__atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+	while (uring_enter(uring.fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0) < 0)
+	{
+		if (errno == EINTR)
+			return; // A signal (stats dump) interrupted the wait
+		if (errno != EAGAIN && errno != EBUSY)
+			fatal_error(NULL);
+		to_submit = 0; // Whatever was accepted is already consumed
+		if (!wait)
+			return;
+	}
+}
+
+struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	// Ring full: let the kernel consume what is queued so far
+	if (uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+		uring_submit(0);
+	index = uring.sq_local_tail & *uring.sq_mask;
+	sqe = &uring.sqes[index];
+	bzero(sqe, sizeof(*sqe));
+	uring.sq_array[index] = index;
+	uring.sq_local_tail++;
+	return sqe;
+}
+
+// Accepts carry the listener's fd above the tag bits
+void uring_arm_accept(int listener)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = URING_OP_ACCEPT | (unsigned long long)listener << 4;
+}
+
+// Out of fds with nothing left to shed: an accept re-armed now would fail at
+// once, so wait for the next connection to shed instead
+void uring_arm_accept_poll(int listener)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = listener;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_OP_ACCEPT | URING_ACCEPT_POLL | (unsigned long long)listener << 4;
+}
+
+void uring_arm_recv(t_client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	// A multishot recv would read the socket dry, so a rate-limited client
+	// gets one receive at a time, sized to its tokens
+	if (rate_limited(client))
+	{
+		sqe->ioprio = 0;
+		sqe->len = rate_read_allowance(client, URING_BUFFER_SIZE);
+		if (config.rate_lines > 0 && !client->binary)
+			sqe->len = line_rate_allowance(client, sqe->len);
+	}
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = (unsigned long)client | URING_OP_RECV;
+	client->uring_inflight++;
+}
+
+void uring_arm_wake(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = current_worker->wake_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_OP_WAKE;
+}
+
+// One sendmsg per client per iteration, covering up to FLUSH_IOVECS messages
+void uring_arm_send(t_client *client)
+{
+	t_outbound *queue = &client->outbound;
+	struct io_uring_sqe *sqe;
+	size_t iov_count = 0;
+
+	if (client->uring_send == NULL)
+	{
+		client->uring_send = malloc(sizeof(*client->uring_send));
+		if (client->uring_send == NULL)
+			fatal_error(NULL);
+	}
+	client->uring_send->bytes = 0;
+	while (iov_count < queue->count && iov_count < FLUSH_IOVECS)
+	{
+		t_message *message = queue->entries[(queue->head + iov_count) & (queue->capacity - 1)];
+		size_t offset = iov_count == 0 ? queue->head_offset : 0;
+
+		client->uring_send->iov[iov_count].iov_base = message->bytes + offset;
+		client->uring_send->iov[iov_count].iov_len = message->length - offset;
+		client->uring_send->bytes += message->length - offset;
+		iov_count++;
+	}
+	bzero(&client->uring_send->header, sizeof(client->uring_send->header));
+	client->uring_send->header.msg_iov = client->uring_send->iov;
+	client->uring_send->header.msg_iovlen = iov_count;
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = client->fd;
+	sqe->addr = (unsigned long)&client->uring_send->header;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)client | URING_OP_SEND;
+	client->send_in_flight = 1;
+	client->uring_inflight++;
+	STAT_ADD(flush_calls, 1);
+	STAT_ADD(flush_messages, iov_count);
+}
+
+// Send RING_READY with the ring's fds attached, in place of the queue
+void uring_arm_ring_ready(t_client *client, int *fds)
+{
+	struct io_uring_sqe *sqe;
+	struct cmsghdr *message;
+
+	if (client->uring_send == NULL)
+	{
+		client->uring_send = malloc(sizeof(*client->uring_send));
+		if (client->uring_send == NULL)
+			fatal_error(NULL);
+	}
+	client->uring_send->iov[0].iov_base = RING_READY;
+	client->uring_send->iov[0].iov_len = strlen(RING_READY);
+	client->uring_send->bytes = strlen(RING_READY);
+	bzero(&client->uring_send->header, sizeof(client->uring_send->header));
+	bzero(client->uring_send->control, sizeof(client->uring_send->control));
+	client->uring_send->header.msg_iov = client->uring_send->iov;
+	client->uring_send->header.msg_iovlen = 1;
+	client->uring_send->header.msg_control = client->uring_send->control;
+	client->uring_send->header.msg_controllen = sizeof(client->uring_send->control);
+	message = CMSG_FIRSTHDR(&client->uring_send->header);
+	message->cmsg_level = SOL_SOCKET;
+	message->cmsg_type = SCM_RIGHTS;
+	message->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(message), fds, 3 * sizeof(int));
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = client->fd;
+	sqe->addr = (unsigned long)&client->uring_send->header;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)client | URING_OP_SEND;
+	client->send_in_flight = 1;
+	client->uring_inflight++;
+}
+
+// Wake polls carry a ring client above the tag bits, watching the eventfd it
+// signals when it made room; 0 is the worker's own wakeup eventfd
+void uring_arm_ring(t_client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = client->ring->space_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (unsigned long)client | URING_OP_WAKE;
+	client->uring_inflight++;
+}
+
+// Cancel the request tagged user_data; its own completion reports the outcome
+void uring_cancel(unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = URING_OP_CANCEL;
+}
+
+void uring_arm_flush_timer(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = flush_timer_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_OP_FLUSH_TIMER;
+}
+
+void uring_arm_link_timer(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = link_timer_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_OP_LINK_TIMER;
+}
+
+void uring_arm_throttle_timer(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = throttle_timer_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_OP_THROTTLE_TIMER;
+}
+
+void uring_arm_idle_timer(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = idle_timer_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_OP_FLUSH_TIMER | URING_TIMER_IDLE;
+}
+
+void uring_handle_accept(struct io_uring_cqe *cqe)
+{
+	int listener = cqe->user_data >> 4;
+	t_client *client;
+
+	if (cqe->user_data & URING_ACCEPT_POLL)
+	{
+		if (!handing_over)
+			uring_arm_accept(listener); // A connection is waiting, try again
+		return;
+	}
+	// At the fd limit the kernel fails the accept before it looks at the
+	// queue: shed a pending connection, or wait for one to come
+	if ((cqe->res == -EMFILE || cqe->res == -ENFILE) && !handing_over)
+	{
+		if (shed_connection(listener))
+			uring_arm_accept(listener);
+		else
+			uring_arm_accept_poll(listener);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !handing_over)
+		uring_arm_accept(listener); // Multishot accept ended, re-arm it
+	if (cqe->res < 0)
+		return;
+	if (listener == peer_socket)
+	{
+		client = link_open(cqe->res, -1);
+		if (!handing_over)
+			uring_arm_recv(client);
+		return;
+	}
+	if (config.worker_count > 1)
+		drain_worker_inbox(); // Earlier broadcasts must not reach the new client
+
+	client = initialize_new_client(cqe->res, listener == binary_socket);
+	client->local = listener == unix_socket;
+	if (!handing_over)
+		uring_arm_recv(client);
+	notify_client_arrival(client);
+}
+
+void uring_handle_recv(t_client *client, struct io_uring_cqe *cqe)
+{
+	int more = cqe->flags & IORING_CQE_F_MORE;
 
-// Global state
-fd_set read_set, write_set, master_set;
-int server_socket = 0, highest_fd = 0, next_client_id = 0;
-t_client client_list[MAX_CLIENTS];
+	// A client past its read budget for this turn waits until recipients
+	// caught up. Every later completion of the client is carried too, which
+	// keeps them in order.
+	if (client->uring_turn != uring_turn)
+	{
+		client->uring_turn = uring_turn;
+		client->uring_turn_bytes = 0;
+	}
+	if (!handing_over && (client->read_carried ||
+						  (client->uring_turn_bytes >= (size_t)config.read_budget && !client->closing)))
+	{
+		client->read_carried = 1;
+		carried_recvs = grow_array(carried_recvs, &carried_recv_capacity, carried_recv_count + 1, sizeof(*cqe));
+		carried_recvs[carried_recv_count++] = *cqe;
+		return;
+	}
+	// Under backpressure the buffer is not recycled: once the ring runs dry
+	// the kernel stops reading from sockets until resume_reading() replays these
+	if (reads_paused)
+	{
+		held_recvs = grow_array(held_recvs, &held_capacity, held_count + 1, sizeof(*cqe));
+		held_recvs[held_count++] = *cqe;
+		return;
+	}
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
 
-char send_buffer[BUFFER_SIZE], receive_buffer[BUFFER_SIZE];
+		if (cqe->res > 0 && !client->closing)
+		{
+			STAT_ADD(bytes_in, cqe->res);
+			client->active_usec = wakeup_usec;
+			client->byte_tokens -= cqe->res;
+			client->uring_turn_bytes += cqe->res;
+			client_received_data(client, uring.buffers + (size_t)id * URING_BUFFER_SIZE, cqe->res);
+		}
+		uring_recycle_buffer(id);
+	}
+	if (more)
+		return;
 
-// ============================================================================
-// ERROR HANDLING
-// ============================================================================
+	client->uring_inflight--;
+	if (client->closing)
+		client_record_release(client);
+	else if (handing_over)
+		return; // Cancelled, the new process reads from the socket
+	else if ((cqe->res > 0 || cqe->res == -ENOBUFS) && rate_read_allowance(client, 1) == 0)
+	{
+		throttle_client(client);
+		client->recv_stopped = 1; // Re-armed when the throttle timer releases it
+	}
+	else if (cqe->res > 0 || cqe->res == -ENOBUFS)
+		uring_arm_recv(client); // Multishot stopped (buffers ran out) or one-shot done, re-arm
+	else
+	{
+		notify_client_departure(client);
+		cleanup_client(client);
+	}
+}
 
-void fatal_error(const char *error_message)
+void uring_handle_send(t_client *client, struct io_uring_cqe *cqe)
 {
-	if (error_message)
-		write(STDERR_FILENO, error_message, strlen(error_message));
+	client->uring_inflight--;
+	client->send_in_flight = 0;
+	if (client->closing)
+	{
+		client_record_release(client);
+		return;
+	}
+	if (cqe->res == -ECANCELED && handing_over)
+		return; // The queue moves to the new process as it is
+	if (client->uring_send->header.msg_control)
+		ring_ready_sent(client, cqe->res);
+	else if (cqe->res < 0)
+		outbound_clear(&client->outbound); // Peer is gone, recv reports the departure
 	else
-		write(STDERR_FILENO, "Fatal error\n", 12);
-	exit(1);
+	{
+		STAT_ADD(flush_bytes, cqe->res);
+		if ((size_t)cqe->res < client->uring_send->bytes)
+			STAT_ADD(short_writes, 1);
+		outbound_consume(&client->outbound, cqe->res);
+	}
+	if (client->ring)
+		ring_flush(client); // Whatever is left goes to the ring now
+	else if (client->outbound.count > 0 && !handing_over)
+	{
+		if (cqe->res >= 0 && (size_t)cqe->res == client->uring_send->bytes)
+			uring_catching_up++; // Carried receives wait for this one
+		uring_arm_send(client); // Short send or more queued: continue right away
+	}
 }
 
-// ============================================================================
-// MESSAGE BROADCASTING
-// ============================================================================
-
-void broadcast_to_all_except(int sender_fd, const char *message)
+void uring_handle_ring(t_client *client, struct io_uring_cqe *cqe)
 {
-	for (int fd = 0; fd <= highest_fd; fd++)
+	if (!(cqe->flags & IORING_CQE_F_MORE))
 	{
-		if (FD_ISSET(fd, &write_set) && fd != server_socket && fd != sender_fd)
+		client->uring_inflight--;
+		if (client->closing)
 		{
-			send(fd, message, strlen(message), 0);
+			client_record_release(client);
+			return;
 		}
+		if (!handing_over)
+			uring_arm_ring(client);
 	}
+	if (!client->closing)
+		ring_space_signalled(client);
+}
+
+// Process the carried receive completions in their original order; a client
+// past its budget again has the rest carried anew
+void replay_carried_recvs(void)
+{
+	struct io_uring_cqe *carried = carried_recvs;
+	size_t replay_count = carried_recv_count;
+
+	carried_recvs = NULL;
+	carried_recv_count = carried_recv_capacity = 0;
+	for (size_t i = 0; i < replay_count; i++)
+		((t_client *)(carried[i].user_data & ~(unsigned long)URING_OP_MASK))->read_carried = 0;
+	for (size_t i = 0; i < replay_count; i++)
+		uring_handle_recv((t_client *)(carried[i].user_data & ~(unsigned long)URING_OP_MASK), &carried[i]);
+	free(carried);
 }
 
-void notify_client_arrival(int new_client_fd)
+// Submit the SQEs prepared since the last call (sends queued by the previous
+// flush included) and wait in the same io_uring_enter(), then handle completions.
+// Carried receives are input already in hand, so they skip the wait.
+void run_uring_iteration(void)
 {
-	int client_id = client_list[new_client_fd].client_id;
-	sprintf(send_buffer, "server: client %d just arrived\n", client_id);
-	broadcast_to_all_except(new_client_fd, send_buffer);
+	unsigned head, tail;
+	int carried = carried_recv_count > 0;
+	int replay = carried && uring_catching_up == 0;
+
+	if (busy_poll_spinning() || carried)
+		uring_poll();
+	else
+		uring_submit(1);
+	mark_wakeup();
+	uring_turn++;
+	uring_catching_up = 0;
+	if (replay)
+		replay_carried_recvs();
+	head = *uring.cq_head;
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	busy_poll_result(head != tail || carried);
+
+	while (head != tail)
+	{
+		struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+		t_client *client = (t_client *)(unsigned long)(cqe->user_data & ~(unsigned long long)URING_OP_MASK);
+
+		switch (cqe->user_data & URING_OP_MASK)
+		{
+		case URING_OP_ACCEPT:
+			uring_handle_accept(cqe);
+			break;
+		case URING_OP_RECV:
+			uring_handle_recv(client, cqe);
+			break;
+		case URING_OP_SEND:
+			uring_handle_send(client, cqe);
+			break;
+		case URING_OP_WAKE:
+			if (client)
+			{
+				uring_handle_ring(client, cqe);
+				break;
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_arm_wake();
+			drain_worker_inbox();
+			break;
+		case URING_OP_FLUSH_TIMER:
+			if (cqe->user_data & URING_TIMER_IDLE)
+			{
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					uring_arm_idle_timer();
+				idle_timer_expired();
+				break;
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_arm_flush_timer();
+			flush_window_expired();
+			break;
+		case URING_OP_LINK_TIMER:
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_arm_link_timer();
+			link_timer_expired();
+			break;
+		case URING_OP_THROTTLE_TIMER:
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_arm_throttle_timer();
+			throttle_timer_expired();
+			break;
+		case URING_OP_CANCEL:
+			break;
+		}
+		head++;
+		if (head == tail)
+		{
+			// Pick up completions that arrived while we were busy
+			__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+			tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
 }
 
-void notify_client_departure(int departed_client_fd)
+// Check at startup that the kernel has everything the engine relies on:
+// provided buffer rings and multishot recv (Linux 6.0+)
+int uring_supported(void)
 {
-	int client_id = client_list[departed_client_fd].client_id;
-	sprintf(send_buffer, "server: client %d just left\n", client_id);
-	broadcast_to_all_except(departed_client_fd, send_buffer);
+	t_uring probe_ring;
+	t_uring saved = uring;
+	int pair[2];
+	int supported = 0;
+
+	if (uring_init(&probe_ring, 8) < 0)
+		return 0;
+	uring = probe_ring;
+	if (uring_init_buffers(&uring) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0)
+	{
+		struct io_uring_sqe *sqe = uring_get_sqe();
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = pair[0];
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+		write(pair[1], "x", 1);
+		uring_submit(1);
+		supported = uring.cqes[*uring.cq_head & *uring.cq_mask].res == 1;
+		close(pair[0]);
+		close(pair[1]);
+	}
+	close(uring.fd); // The ring mappings are left to exit, the probe runs once
+	munmap(uring.buffer_ring, sizeof(struct io_uring_buf) * URING_BUFFER_COUNT);
+	free(uring.buffers);
+	uring = saved;
+	return supported;
 }
 
 // ============================================================================
-// CLIENT MANAGEMENT
+// BACKPRESSURE
 // ============================================================================
 
-void initialize_new_client(int client_fd)
+// Process the io_uring receive completions held while reads were paused
+void replay_held_recvs(void)
 {
-	client_list[client_fd].client_id = next_client_id++;
-	client_list[client_fd].message_buffer = NULL;
+	struct io_uring_cqe *held = held_recvs;
+	size_t replay_count = held_count;
+
+	held_recvs = NULL;
+	held_count = held_capacity = 0;
+	for (size_t i = 0; i < replay_count; i++)
+		uring_handle_recv((t_client *)(held[i].user_data & ~(unsigned long)URING_OP_MASK), &held[i]);
+	free(held);
 }
 
-void cleanup_client(int client_fd)
+// Lift backpressure once queued messages are back under half the budget and
+// no local backlog holds more than half the per-client cap. Parked readers
+// and held io_uring completions are then processed in their original order;
+// if that pauses reading again they are simply parked or held anew.
+void resume_reading(void)
 {
-	FD_CLR(client_fd, &master_set);
-	if (client_list[client_fd].message_buffer)
+	if (__atomic_load_n(&live_message_bytes, __ATOMIC_RELAXED) > config.queue_budget / 2)
+		return;
+	for (size_t i = 0; i < registry.active_count; i++)
+	{
+		if (registry.active[i]->outbound.bytes > (size_t)config.client_queue_max / 2)
+			return;
+	}
+	reads_paused = 0;
+
+	t_client **parked = paused_list;
+	size_t parked_count = paused_count;
+	paused_list = NULL;
+	paused_count = paused_capacity = 0;
+	for (size_t i = 0; i < parked_count; i++)
 	{
-		free(client_list[client_fd].message_buffer);
-		client_list[client_fd].message_buffer = NULL;
+		t_client *client = parked[i];
+
+		client->read_paused = 0;
+		if (client->closing)
+			client_record_release(client);
+		else
+		{
+			if (config.backend == BACKEND_SELECT)
+				FD_SET(client->fd, &master_set);
+			handle_client_message(client);
+		}
 	}
-	close(client_fd);
+	free(parked);
+	replay_held_recvs();
 }
 
 // ============================================================================
-// MESSAGE PROCESSING
+// HOT RESTART
 // ============================================================================
 
-char *append_to_buffer(char *existing_buffer, char *new_data)
+void write_all(int fd, const char *data, size_t length)
 {
-	char *combined_buffer;
-	int existing_length;
+	while (length > 0)
+	{
+		ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
 
-	if (existing_buffer == NULL)
-		existing_length = 0;
-	else
-		existing_length = strlen(existing_buffer);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			fatal_error("Handover failed\n");
+		data += written;
+		length -= written;
+	}
+}
 
-	combined_buffer = malloc(sizeof(*combined_buffer) * (existing_length + strlen(new_data) + 1));
-	if (combined_buffer == NULL)
-		return NULL;
+void read_all(int fd, char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t received = read(fd, data, length);
+
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			fatal_error("Handover failed\n");
+		data += received;
+		length -= received;
+	}
+}
+
+// Send one record with fd attached, or none if fd is -1; the caller writes
+// the record's variable-length parts right after it
+void handover_send_record(t_handover_record *record, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr header;
+	struct iovec iov;
 
-	combined_buffer[0] = '\0';
-	if (existing_buffer != NULL)
-		strcat(combined_buffer, existing_buffer);
+	bzero(&header, sizeof(header));
+	bzero(control, sizeof(control));
+	iov.iov_base = record;
+	iov.iov_len = sizeof(*record);
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	if (fd >= 0)
+	{
+		struct cmsghdr *message;
 
-	free(existing_buffer); // Free old buffer
-	strcat(combined_buffer, new_data);
-	return combined_buffer;
+		header.msg_control = control;
+		header.msg_controllen = sizeof(control);
+		message = CMSG_FIRSTHDR(&header);
+		message->cmsg_level = SOL_SOCKET;
+		message->cmsg_type = SCM_RIGHTS;
+		message->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(message), &fd, sizeof(int));
+	}
+	if (sendmsg(handover_fd, &header, MSG_NOSIGNAL) != sizeof(*record))
+		fatal_error("Handover failed\n");
 }
 
-int extract_complete_message(char **buffer, char **extracted_message)
+// Receive one record and the fd attached to it, -1 if none
+void handover_receive_record(int fd, t_handover_record *record)
 {
-	char *remaining_buffer;
-	int position;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr header;
+	struct iovec iov;
+	struct cmsghdr *message;
+
+	bzero(&header, sizeof(header));
+	iov.iov_base = record;
+	iov.iov_len = sizeof(*record);
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+	if (recvmsg(fd, &header, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(*record))
+		fatal_error("Handover failed\n");
+	record->fd = -1;
+	message = CMSG_FIRSTHDR(&header);
+	if (message && message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_RIGHTS)
+		memcpy(&record->fd, CMSG_DATA(message), sizeof(int));
+}
 
-	*extracted_message = NULL;
-	if (*buffer == NULL)
-		return 0; // No buffer to process
+// Old process, on SIGUSR2: exec the binary again with one end of a socketpair
+// as fd 3 and wait for the new instance to report in. On failure this
+// process simply keeps serving.
+void start_handover(void)
+{
+	extern char **environ;
+	char **environment;
+	size_t count = 0;
+	uint64_t one = 1;
+	int pair[2];
+	char ready;
+	pid_t pid;
 
-	position = 0;
-	while ((*buffer)[position])
+	while (environ[count])
+		count++;
+	environment = malloc(sizeof(*environment) * (count + 2));
+	if (environment == NULL)
+		fatal_error(NULL);
+	memcpy(environment, environ, sizeof(*environment) * count);
+	environment[count] = "MINI_SERV_HANDOVER_FD=3";
+	environment[count + 1] = NULL;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		pid = -1;
+	else if ((pid = fork()) == 0)
+	{
+		// Only the new instance's end of the pair survives the exec
+		if (pair[1] != 3)
+			dup2(pair[1], 3);
+		if (syscall(SYS_close_range, 4, ~0U, 0) < 0)
+		{
+			for (int fd = 4; fd < 65536; fd++)
+				close(fd);
+		}
+		execve(server_path, server_argv, environment);
+		_exit(1);
+	}
+	free(environment);
+	if (pid >= 0)
+		close(pair[1]);
+	if (pid < 0 || read(pair[0], &ready, 1) != 1)
 	{
-		if ((*buffer)[position] == '\n') // Found complete message
+		if (pid >= 0)
 		{
-			// Allocate space for remaining data after newline
-			remaining_buffer = calloc(1, sizeof(*remaining_buffer) * (strlen(*buffer + position + 1) + 1));
-			if (remaining_buffer == NULL)
-				return -1; // Memory allocation failed
+			close(pair[0]);
+			waitpid(pid, NULL, 0);
+		}
+		write(STDERR_FILENO, "Handover failed\n", 16);
+		return;
+	}
+	__atomic_store_n(&handover_fd, pair[0], __ATOMIC_RELEASE);
+	for (int i = 1; i < config.worker_count; i++)
+		write(workers[i].wake_fd, &one, sizeof(one));
+}
 
-			strcpy(remaining_buffer, *buffer + position + 1); // Copy remaining data
+// Cancel this worker's io_uring requests and wait for their completions, so
+// nothing is read from or written to a socket after it was handed over.
+// Data that still arrives is kept as unparsed input.
+void uring_settle(void)
+{
+	int pending = 1;
 
-			*extracted_message = *buffer;			   // Return complete message
-			(*extracted_message)[position + 1] = '\0'; // Null-terminate message (include \n)
+	uring_cancel(URING_OP_ACCEPT | (unsigned long long)server_socket << 4);
+	if (binary_socket >= 0)
+		uring_cancel(URING_OP_ACCEPT | (unsigned long long)binary_socket << 4);
+	if (peer_socket >= 0 && current_worker == &workers[0])
+		uring_cancel(URING_OP_ACCEPT | (unsigned long long)peer_socket << 4);
+	if (unix_socket >= 0)
+		uring_cancel(URING_OP_ACCEPT | (unsigned long long)unix_socket << 4);
+	for (size_t i = 0; i < registry.active_count; i++)
+	{
+		t_client *client = registry.active[i];
 
-			*buffer = remaining_buffer; // Update buffer with remaining data
-			return 1;					// Successfully extracted message
+		if (client->uring_inflight > 0)
+			uring_cancel((unsigned long)client | URING_OP_RECV);
+		if (client->send_in_flight)
+			uring_cancel((unsigned long)client | URING_OP_SEND);
+	}
+	while (pending)
+	{
+		run_uring_iteration();
+		pending = 0;
+		for (size_t i = 0; i < registry.active_count; i++)
+		{
+			if (registry.active[i]->uring_inflight > 0)
+				pending = 1;
 		}
-		position++;
 	}
-	return 0; // No complete message found
 }
 
-void broadcast_client_message(int sender_fd, char *message)
+// Write this worker's listeners and clients to the new process
+void handover_send_worker(void)
 {
-	int client_id = client_list[sender_fd].client_id;
-	sprintf(send_buffer, "client %d: %s", client_id, message);
-	broadcast_to_all_except(sender_fd, send_buffer);
-}
+	int worker = current_worker - workers;
+	t_handover_record record;
 
-// ============================================================================
-// CONNECTION HANDLING
-// ============================================================================
+	pthread_mutex_lock(&handover_lock);
+	bzero(&record, sizeof(record));
+	record.type = HANDOVER_LISTENER;
+	record.worker = worker;
+	handover_send_record(&record, server_socket);
+	if (binary_socket >= 0)
+	{
+		record.binary = 1;
+		handover_send_record(&record, binary_socket);
+	}
+	if (peer_socket >= 0 && worker == 0)
+	{
+		record.binary = 2;
+		handover_send_record(&record, peer_socket);
+	}
+	if (unix_socket >= 0 && worker == 0)
+	{
+		record.binary = 3;
+		handover_send_record(&record, unix_socket);
+	}
+	for (size_t i = 0; i < registry.active_count; i++)
+	{
+		t_client *client = registry.active[i];
+		t_outbound *queue = &client->outbound;
+		char room_name[ROOM_NAME_MAX] = "lobby";
 
-void handle_new_connection(void)
-{
-	struct sockaddr_in client_address;
-	socklen_t address_length = sizeof(client_address);
-	int new_client_fd;
+		if (client->evicted || client->link)
+			continue; // Closed when this process exits; links are dialed again
+		if (client->room != LOBBY_ROOM)
+		{
+			pthread_mutex_lock(&room_lock);
+			strcpy(room_name, room_names[client->room]);
+			pthread_mutex_unlock(&room_lock);
+		}
+		bzero(&record, sizeof(record));
+		record.type = HANDOVER_CLIENT;
+		record.worker = worker;
+		record.binary = client->binary;
+		record.local = client->local;
+		record.client_id = client->client_id;
+		record.arrival_sequence = client->arrival_sequence;
+		record.inbound_length = client->inbound.length;
+		record.outbound_length = queue->bytes;
+		record.room_length = strlen(room_name);
+		handover_send_record(&record, client->fd);
+		write_all(handover_fd, client->inbound.data, client->inbound.length);
+		for (size_t j = 0; j < queue->count; j++)
+		{
+			t_message *message = queue->entries[(queue->head + j) & (queue->capacity - 1)];
+			size_t offset = j == 0 ? queue->head_offset : 0;
 
-	new_client_fd = accept(server_socket, (struct sockaddr *)&client_address, &address_length);
-	if (new_client_fd < 0)
-		return; // Accept failed, but don't crash
+			write_all(handover_fd, message->bytes + offset, message->length - offset);
+		}
+		write_all(handover_fd, room_name, record.room_length);
+	}
+	pthread_mutex_unlock(&handover_lock);
+}
 
-	// Add client to monitoring
-	FD_SET(new_client_fd, &master_set);
-	if (new_client_fd > highest_fd)
-		highest_fd = new_client_fd;
+// Every worker runs this once a handover started: stop serving, settle what
+// is in flight, then pass the sockets on. Worker 0 ends the stream and exits.
+void hand_over_worker(void)
+{
+	t_handover_record record;
 
-	// Initialize client data
-	initialize_new_client(new_client_fd);
+	handing_over = 1;
+	// Once every worker got here nobody reads from clients any more, so the
+	// inboxes hold everything that will ever reach them
+	pthread_barrier_wait(&handover_barrier);
+	if (config.worker_count > 1)
+		drain_worker_inbox();
+	reads_paused = 0;
+	replay_held_recvs();
+	replay_carried_recvs();
+	// Streamed lines end here; whatever follows is a new line to the new process
+	for (size_t i = 0; i < registry.active_count; i++)
+	{
+		if (registry.active[i]->stream_out)
+			stream_chunk(registry.active[i], "\n", 1, 1);
+	}
+	for (size_t i = 0; i < registry.active_count; i++)
+	{
+		if (registry.active[i]->stream_open)
+			stream_cut(registry.active[i]);
+	}
+	// Rings are not handed over: their clients leave and connect again
+	for (size_t i = 0; i < registry.active_count; i++)
+	{
+		if (registry.active[i]->ring)
+			disconnect_later(registry.active[i]);
+	}
+	flush_scheduled_clients(); // Evicted clients leave, sockets take what they can
+	if (config.backend == BACKEND_IO_URING)
+		uring_settle();
+	handover_send_worker();
+	pthread_barrier_wait(&handover_barrier);
+	if (current_worker != &workers[0])
+		pthread_exit(NULL);
 
-	// Notify other clients
-	notify_client_arrival(new_client_fd);
+	bzero(&record, sizeof(record));
+	if (stats_listener >= 0)
+	{
+		record.type = HANDOVER_LISTENER;
+		record.worker = -1;
+		handover_send_record(&record, stats_listener);
+	}
+	record.type = HANDOVER_END;
+	record.next_client_id = __atomic_load_n(&next_client_id, __ATOMIC_RELAXED);
+	record.worker_count = config.worker_count;
+	handover_send_record(&record, -1);
+	exit(0);
 }
 
-void handle_client_message(int client_fd)
+// New process: report in, then read the old process's sockets and state.
+// The worker count follows the old process, since each worker's clients
+// are handed to the worker with the same index.
+void handover_receive(int fd)
 {
-	ssize_t bytes_received;
-	char *extracted_message = NULL;
+	t_handover_record record;
+	char ready = 1;
+
+	write_all(fd, &ready, 1);
+	while (1)
+	{
+		handover_receive_record(fd, &record);
+		if (record.type == HANDOVER_END)
+			break;
+		size_t length = record.inbound_length + record.outbound_length + record.room_length;
 
-	bytes_received = recv(client_fd, receive_buffer, sizeof(receive_buffer) - 1, 0);
+		record.data = malloc(length + 1);
+		if (record.data == NULL)
+			fatal_error(NULL);
+		read_all(fd, record.data, length);
+		handed_records = realloc(handed_records, sizeof(*handed_records) * (handed_count + 1));
+		if (handed_records == NULL)
+			fatal_error(NULL);
+		handed_records[handed_count++] = record;
+	}
+	close(fd);
+	next_client_id = record.next_client_id;
+	config.worker_count = record.worker_count;
+}
 
-	if (bytes_received <= 0) // Client disconnected
+// The listener the old process used for worker (-1: the stats port), or -1
+int handed_listener(int worker, int binary)
+{
+	for (size_t i = 0; i < handed_count; i++)
 	{
-		notify_client_departure(client_fd);
-		cleanup_client(client_fd);
-		return;
+		t_handover_record *record = &handed_records[i];
+
+		if (record->type == HANDOVER_LISTENER && record->worker == worker && record->binary == binary)
+			return record->fd;
 	}
+	return -1;
+}
+
+// Register the connections this worker's counterpart in the old process
+// owned. Their unparsed input is framed only once all of them are back,
+// since it may produce broadcasts.
+void restore_handed_clients(void)
+{
+	int worker = current_worker - workers;
 
-	// Process received data
-	receive_buffer[bytes_received] = '\0';
-	client_list[client_fd].message_buffer = append_to_buffer(client_list[client_fd].message_buffer, receive_buffer);
+	for (size_t i = 0; i < handed_count; i++)
+	{
+		t_handover_record *record = &handed_records[i];
+		char *outbound = record->data + record->inbound_length;
+		char *room_name = outbound + record->outbound_length;
+
+		if (record->type != HANDOVER_CLIENT || record->worker != worker)
+			continue;
+		t_client *client = register_client(record->fd, record->client_id, record->binary);
+
+		client->arrival_sequence = record->arrival_sequence;
+		client->local = record->local;
+		if (config.rooms)
+		{
+			room_remove(client);
+			room_add(client, room_intern(room_name, record->room_length));
+		}
+		if (record->outbound_length > 0)
+		{
+			t_message *message = message_create(NULL, 0, outbound, record->outbound_length);
 
-	// Extract and broadcast all complete messages
-	while (extract_complete_message(&client_list[client_fd].message_buffer, &extracted_message))
+			outbound_push(&client->outbound, message, 0);
+			message_release(message);
+			schedule_flush(client);
+		}
+		if (config.backend == BACKEND_IO_URING)
+			uring_arm_recv(client);
+		else if (event_add(client->fd) < 0)
+			client->evicted = 1; // Over the select limit: dropped by the next flush
+	}
+	for (size_t i = 0; i < handed_count; i++)
 	{
-		broadcast_client_message(client_fd, extracted_message);
-		free(extracted_message);
-		extracted_message = NULL;
+		t_handover_record *record = &handed_records[i];
+
+		if (record->type != HANDOVER_CLIENT || record->worker != worker)
+			continue;
+		if (record->inbound_length > 0)
+			client_received_data(client_find_by_fd(record->fd), record->data, record->inbound_length);
+		free(record->data);
 	}
+	flush_scheduled_clients(); // The loop would only flush after its first event
 }
 
 // ============================================================================
 // SERVER SETUP
 // ============================================================================
 
-void setup_server_socket(int port)
+int open_listener(int port)
 {
 	struct sockaddr_in server_address;
 	socklen_t address_length = sizeof(server_address);
+	int listener;
+	int enable = 1;
 
-	// Create socket
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_socket < 0)
+	// Create socket; a restarted server may rebind while old connections
+	// linger in TIME_WAIT
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		fatal_error(NULL);
+
+	// Every worker binds its own listener; the kernel spreads connections
+	if (config.worker_count > 1 && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
 		fatal_error(NULL);
 
 	// Configure server address
 	bzero(&server_address, sizeof(server_address));
 	server_address.sin_family = AF_INET;
-	server_address.sin_addr.s_addr = htonl(LOCALHOST_IP); // 127.0.0.1
+	server_address.sin_addr = config.bind_address; // 127.0.0.1 unless MINI_SERV_BIND says otherwise
 	server_address.sin_port = htons(port);
 
 	// Bind and listen
-	if (bind(server_socket, (struct sockaddr *)&server_address, address_length) < 0)
+	if (bind(listener, (struct sockaddr *)&server_address, address_length) < 0)
 		fatal_error(NULL);
-	if (listen(server_socket, 10) < 0)
+	if (listen(listener, config.backlog) < 0)
 		fatal_error(NULL);
+	set_nonblocking(listener);
+	return listener;
+}
 
-	// Initialize file descriptor sets
-	FD_ZERO(&master_set);
-	FD_SET(server_socket, &master_set);
-	highest_fd = server_socket;
+// A socket file an earlier run left at the path is replaced, anything else
+// there makes bind() fail
+int open_unix_listener(const char *path)
+{
+	struct sockaddr_un address;
+	struct stat status;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (listener < 0)
+		fatal_error(NULL);
+	bzero(&address, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path); // Length checked by load_config()
+	if (lstat(path, &status) == 0 && S_ISSOCK(status.st_mode))
+		unlink(path);
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0)
+		fatal_error(NULL);
+	if (listen(listener, config.backlog) < 0)
+		fatal_error(NULL);
+	set_nonblocking(listener);
+	return listener;
+}
+
+void setup_server_socket(int port)
+{
+	int worker = current_worker - workers;
+
+	// After a hot restart the old process's listeners are reused
+	server_socket = handed_listener(worker, 0);
+	if (server_socket < 0)
+		server_socket = open_listener(port);
+	if (config.binary_port > 0)
+	{
+		binary_socket = handed_listener(worker, 1);
+		if (binary_socket < 0)
+			binary_socket = open_listener(config.binary_port);
+	}
+
+	// Held back for shedding connections when the process runs out of fds
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (reserve_fd < 0)
+		fatal_error(NULL);
+
+	if (config.flush_window_usec > 0)
+	{
+		flush_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (flush_timer_fd < 0)
+			fatal_error(NULL);
+	}
+
+	if (config.rate_lines > 0 || config.rate_bytes > 0)
+	{
+		throttle_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (throttle_timer_fd < 0)
+			fatal_error(NULL);
+	}
+
+	if (config.idle_usec > 0 || config.stream_stall_usec > 0)
+	{
+		idle_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (idle_timer_fd < 0)
+			fatal_error(NULL);
+	}
+
+	// Worker 0 serves the node links
+	if (worker == 0 && config.peer_port > 0)
+	{
+		peer_socket = handed_listener(0, 2);
+		if (peer_socket < 0)
+			peer_socket = open_listener(config.peer_port);
+	}
+	if (worker == 0 && config.peer_count > 0)
+	{
+		struct itimerspec retry = {.it_interval = {.tv_sec = LINK_RETRY_SEC}, .it_value = {.tv_sec = LINK_RETRY_SEC}};
+
+		link_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (link_timer_fd < 0 || timerfd_settime(link_timer_fd, 0, &retry, NULL) < 0)
+			fatal_error(NULL);
+	}
+
+	// io_uring arms multishot accept/poll requests instead of watching fds
+	if (config.backend == BACKEND_IO_URING)
+	{
+		if (uring_init(&uring, URING_ENTRIES) < 0 || uring_init_buffers(&uring) < 0)
+			fatal_error(NULL);
+		uring_arm_accept(server_socket);
+		if (binary_socket >= 0)
+			uring_arm_accept(binary_socket);
+		if (worker == 0 && peer_socket >= 0)
+			uring_arm_accept(peer_socket);
+		if (unix_socket >= 0)
+			uring_arm_accept(unix_socket);
+		if (current_worker->wake_fd >= 0)
+			uring_arm_wake();
+		if (flush_timer_fd >= 0)
+			uring_arm_flush_timer();
+		if (worker == 0 && link_timer_fd >= 0)
+			uring_arm_link_timer();
+		if (throttle_timer_fd >= 0)
+			uring_arm_throttle_timer();
+		if (idle_timer_fd >= 0)
+			uring_arm_idle_timer();
+		return;
+	}
+
+	// Start watching the listening sockets, the worker's wakeup eventfd and
+	// the flush window, link and throttle timers
+	event_init();
+	if (event_add(server_socket) < 0)
+		fatal_error(NULL);
+	if (binary_socket >= 0 && event_add(binary_socket) < 0)
+		fatal_error(NULL);
+	if (worker == 0 && peer_socket >= 0 && event_add(peer_socket) < 0)
+		fatal_error(NULL);
+	if (unix_socket >= 0 && event_add(unix_socket) < 0)
+		fatal_error(NULL);
+	if (current_worker->wake_fd >= 0 && event_add(current_worker->wake_fd) < 0)
+		fatal_error(NULL);
+	if (flush_timer_fd >= 0 && event_add(flush_timer_fd) < 0)
+		fatal_error(NULL);
+	if (worker == 0 && link_timer_fd >= 0 && event_add(link_timer_fd) < 0)
+		fatal_error(NULL);
+	if (throttle_timer_fd >= 0 && event_add(throttle_timer_fd) < 0)
+		fatal_error(NULL);
+	if (idle_timer_fd >= 0 && event_add(idle_timer_fd) < 0)
+		fatal_error(NULL);
+}
+
+// ============================================================================
+// WORKER THREADS
+// ============================================================================
+
+int server_port;
+
+void run_event_loop(void)
+{
+	while (1)
+	{
+		if (config.backend == BACKEND_IO_URING)
+			run_uring_iteration();
+		else if (config.backend == BACKEND_EPOLL)
+			run_epoll_iteration();
+		else
+			run_select_iteration();
+
+		// Without a flush window, output coalesced during this iteration
+		// leaves now: one sendmsg per recipient however many lines it got
+		if (carried_listener_count > 0)
+			serve_carried_listeners();
+		if (carried_count > 0)
+			serve_carried_readers();
+		if (config.flush_window_usec == 0)
+			flush_scheduled_clients();
+		if (reads_paused)
+			resume_reading();
+		record_loop_busy_time();
+
+		if (stats_dump_requested && current_worker == &workers[0])
+		{
+			stats_dump_requested = 0;
+			dump_stats(STDERR_FILENO);
+		}
+		if (handover_requested && current_worker == &workers[0])
+		{
+			handover_requested = 0;
+			start_handover();
+		}
+		if (__atomic_load_n(&handover_fd, __ATOMIC_ACQUIRE) >= 0)
+			hand_over_worker();
+	}
+}
+
+void *worker_main(void *argument)
+{
+	current_worker = argument;
+	if (config.cpu_count > 0)
+		pin_worker();
+	setup_server_socket(server_port);
+	if (handed_count > 0)
+		restore_handed_clients();
+	if (current_worker == &workers[0] && config.peer_count > 0)
+		link_redial(); // Peers already up are linked right away
+	run_event_loop();
+	return NULL;
+}
+
+// Worker 0 runs on the main thread, the others get their own thread
+void start_workers(int port)
+{
+	server_port = port;
+	for (int i = 0; i < config.worker_count; i++)
+	{
+		inbox_init(&workers[i].inbox);
+		workers[i].wake_fd = -1;
+		if (config.worker_count > 1)
+		{
+			workers[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (workers[i].wake_fd < 0)
+				fatal_error(NULL);
+		}
+	}
+	pthread_barrier_init(&handover_barrier, NULL, config.worker_count);
+	// One Unix socket for all workers, each accepting from it
+	if (config.unix_path)
+	{
+		unix_socket = handed_listener(0, 3);
+		if (unix_socket < 0)
+			unix_socket = open_unix_listener(config.unix_path);
+	}
+	// Workers inherit blocked SIGUSR1 and SIGUSR2 so both requests reach worker 0
+	sigset_t dump_signal, previous_mask;
+	sigemptyset(&dump_signal);
+	sigaddset(&dump_signal, SIGUSR1);
+	sigaddset(&dump_signal, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &dump_signal, &previous_mask);
+	if (config.stats_port > 0)
+		start_stats_server(handed_listener(-1, 0));
+	for (int i = 1; i < config.worker_count; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+			fatal_error(NULL);
+	}
+	pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+	worker_main(&workers[0]);
 }
 
 // ============================================================================
@@ -248,33 +5838,43 @@ int main(int argc, char **argv)
 		fatal_error("Wrong number of arguments\n");
 
 	int port = atoi(argv[1]);
-	setup_server_socket(port);
+	// Set by the old process on a hot restart; not passed on to our own
+	char *handed = getenv("MINI_SERV_HANDOVER_FD");
+	int handed_fd = handed ? atoi(handed) : -1;
+	unsetenv("MINI_SERV_HANDOVER_FD");
+	ssize_t path_length = readlink("/proc/self/exe", server_path, sizeof(server_path) - 1);
+	if (path_length < 0)
+		fatal_error(NULL);
+	server_path[path_length] = '\0';
+	server_argv = argv;
 
-	// Main event loop
-	while (1)
+	load_config();
+	if (config.busy_poll_usec > 0)
+		lock_memory();
+	next_client_id = config.node_id * NODE_ID_RANGE;
+	if (config.backend == BACKEND_IO_URING && !uring_supported())
 	{
-		// Prepare file descriptor sets for select()
-		read_set = write_set = master_set;
-
-		if (select(highest_fd + 1, &read_set, &write_set, NULL, NULL) < 0)
-			continue; // Select failed, try again
+		write(STDERR_FILENO, "io_uring unavailable, using epoll\n", 34);
+		config.backend = BACKEND_EPOLL;
+	}
+	if (handed_fd >= 0)
+		handover_receive(handed_fd);
+	// An old process appends until it sends HANDOVER_END, so the log is only
+	// read once the handover is complete
+	if (config.history_dir)
+		history_open();
 
-		// Check all possible file descriptors
-		for (int fd = 0; fd <= highest_fd; fd++)
-		{
-			if (!FD_ISSET(fd, &read_set))
-				continue; // No activity on this fd
+	// SIGUSR1 dumps the counters to stderr, SIGUSR2 hands the server over to
+	// a fresh copy of the binary; no SA_RESTART so waits wake up
+	struct sigaction dump_action;
+	bzero(&dump_action, sizeof(dump_action));
+	dump_action.sa_handler = request_stats_dump;
+	sigaction(SIGUSR1, &dump_action, NULL);
+	dump_action.sa_handler = request_handover;
+	sigaction(SIGUSR2, &dump_action, NULL);
 
-			if (fd == server_socket)
-			{
-				handle_new_connection();
-			}
-			else
-			{
-				handle_client_message(fd);
-			}
-		}
-	}
+	// Main event loop, on one thread per MINI_SERV_THREADS
+	start_workers(port);
 
 	return 0;
 }
\ No newline at end of file